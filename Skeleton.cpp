@@ -8,6 +8,40 @@
 // Light: point or directional sources
 //=============================================================================================
 #include "framework.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#if !defined(_WIN32)
+#include <fcntl.h> // scene files are mapped into memory
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(ALLOCATION_COUNTING)
+#include <new>
+std::atomic<unsigned long long> allocationCount(0); // heap allocations of all threads since the start
+
+void *operator new(size_t size)
+{
+	allocationCount++;
+	if (void *p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
 
 //---------------------------
 template <class T>
@@ -60,6 +94,445 @@ float magnitude(vec3 v)
 typedef Dnum<vec2> Dnum2;
 
 const int tessellationLevel = 20;
+const float tessellationError = 0.002f; // max geometric error of the adaptive tessellation
+const bool compactVertexFormat = true; // quantized positions, octahedral normals, unorm16 texcoords
+const int maxLods = 4;				   // number of levels of detail generated per surface
+const float lodPixelSize = 64;		   // projected diameter in pixels below which coarser levels are used
+const float lodHysteresis = 0.2f;	   // relative margin around the thresholds to avoid popping
+bool lodEnabled = true;
+const bool proceduralGeometry = false; // evaluate spheres and bowls in the vertex shader, no vertex buffers
+int proceduralTessellation = tessellationLevel; // per frame resolution of the procedural surfaces
+bool impostorBalls = false;						// spheres drawn as ray-cast screen-aligned quads
+bool gpuBallPhysics = false;					// new balls are simulated by transform feedback
+bool frustumCulling = true;
+bool occlusionCulling = false; // objects hidden behind the occluders are not drawn
+bool staticCaching = false; // the objects that did not change are copied from the image of an earlier frame
+bool drawBatching = true; // objects of the same geometry, material and shader in one instanced draw
+bool lightAnimation = true; // the lights orbit
+bool headless = false; // no GL context, geometry is only tessellated on the CPU (benchmarks)
+int screenWidth = windowWidth, screenHeight = windowHeight; // current window size, windowWidth/Height is only the initial one
+
+//---------------------------
+struct FrameStats
+{ // counters of the last rendered frame
+	//---------------------------
+	unsigned int objects, drawCalls, triangles, fullTriangles; // fullTriangles: without level of detail
+	unsigned int culled;									   // objects outside of the view frustum
+	unsigned int occluded;									   // objects behind the occluders
+	unsigned int cached;									   // objects copied from the static layer
+	unsigned int allocations;								   // heap allocations of Scene::Render with ALLOCATION_COUNTING
+	unsigned int lights, maxTileLights;						   // light sources, the longest light list of a screen tile
+	void Reset() { objects = drawCalls = triangles = fullTriangles = culled = occluded = cached = allocations = lights = maxTileLights = 0; }
+};
+
+FrameStats frameStats;
+
+#ifndef TRACING
+#define TRACING 1 // 0 compiles the trace scopes out
+#endif
+
+//---------------------------
+class TraceRecorder
+{ // complete events in a ring buffer per thread slot, written as Chrome Trace Event JSON
+	//---------------------------
+	typedef std::chrono::high_resolution_clock Clock;
+	static const int maxThreads = 64;		   // slot 0: main thread, the others are taken by the threads that record
+	static const unsigned int ringSize = 1 << 16; // events kept per thread, the oldest are overwritten
+
+	struct Event
+	{
+		const char *name; // string literal
+		long long start, duration; // nanoseconds
+	};
+	struct Ring
+	{
+		Event events[ringSize];
+		std::atomic<unsigned int> written{0}; // single writer, read after the writer has finished
+	};
+	std::atomic<Ring *> rings[maxThreads] = {};
+	std::atomic<unsigned long long> usedSlots{0}; // a bit per slot owned by a running thread
+	Clock::time_point origin = Clock::now();
+
+	struct SlotOwner
+	{ // returns the slot when its thread ends, so the short-lived ParallelFor workers reuse the rings
+		TraceRecorder *recorder = nullptr;
+		int slot = -1;
+		~SlotOwner()
+		{
+			if (recorder)
+				recorder->usedSlots.fetch_and(~(1ull << slot));
+		}
+	};
+
+	// the lowest free slot at the first event of the thread, -1 when all are owned and its events are dropped
+	int Slot()
+	{
+		thread_local SlotOwner owner;
+		if (owner.recorder)
+			return owner.slot;
+		unsigned long long used = usedSlots.load();
+		int slot;
+		do
+		{
+			if (~used == 0)
+				return -1;
+			for (slot = 0; used >> slot & 1; slot++)
+				;
+		} while (!usedSlots.compare_exchange_weak(used, used | (1ull << slot)));
+		owner.recorder = this;
+		owner.slot = slot;
+		return slot;
+	}
+
+	Ring *ThreadRing(int slot)
+	{
+		std::atomic<Ring *> &ring = rings[slot];
+		Ring *r = ring.load(std::memory_order_acquire);
+		if (!r)
+		{ // first event of the slot, a racing allocation is dropped
+			Ring *newRing = new Ring;
+			if (ring.compare_exchange_strong(r, newRing))
+				r = newRing;
+			else
+				delete newRing;
+		}
+		return r;
+	}
+
+public:
+	std::atomic<bool> recording{false};
+
+	long long Now() { return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - origin).count(); }
+
+	void Record(const char *name, long long start, long long end)
+	{
+		int slot = Slot();
+		if (slot < 0)
+			return;
+		Ring *r = ThreadRing(slot);
+		unsigned int i = r->written.load(std::memory_order_relaxed);
+		r->events[i % ringSize] = {name, start, end - start};
+		r->written.store(i + 1, std::memory_order_release);
+	}
+
+	// called from the main thread while no workers run
+	void Start()
+	{
+		Slot(); // the main thread takes slot 0, nothing records before the first Start
+		for (std::atomic<Ring *> &ring : rings)
+			if (Ring *r = ring.load())
+				r->written = 0;
+		recording = true;
+	}
+
+	void Stop(const char *fileName)
+	{
+		recording = false;
+		FILE *file = fopen(fileName, "w");
+		if (!file)
+		{
+			printf("Cannot write trace %s\n", fileName);
+			return;
+		}
+		unsigned int nEvents = 0;
+		fprintf(file, "{\"traceEvents\":[\n");
+		for (int t = 0; t < maxThreads; t++)
+		{
+			Ring *r = rings[t].load();
+			if (!r)
+				continue;
+			fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+					nEvents++ ? ",\n" : "", t, t ? "worker" : "main", t);
+			unsigned int written = r->written.load(std::memory_order_acquire);
+			for (unsigned int i = written > ringSize ? written - ringSize : 0; i < written; i++)
+			{
+				const Event &e = r->events[i % ringSize];
+				fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+						e.name, t, e.start / 1000.0, e.duration / 1000.0);
+				nEvents++;
+			}
+		}
+		fprintf(file, "\n]}\n");
+		fclose(file);
+		printf("Trace with %u events written to %s\n", nEvents, fileName);
+	}
+};
+
+TraceRecorder tracer;
+
+//---------------------------
+struct TraceScope
+{ // complete event from construction to destruction
+	//---------------------------
+	const char *name;
+	long long start = 0;
+	TraceScope(const char *_name) : name(tracer.recording.load(std::memory_order_relaxed) ? _name : nullptr)
+	{
+		if (name)
+			start = tracer.Now();
+	}
+	~TraceScope()
+	{
+		if (name)
+			tracer.Record(name, start, tracer.Now());
+	}
+};
+
+#if TRACING
+#define TRACE_NAME2(name, line) name##line
+#define TRACE_NAME(name, line) TRACE_NAME2(name, line)
+#define TRACE_SCOPE(name) TraceScope TRACE_NAME(traceScope, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
+// Runs body(first, last, thread) on disjoint ranges of [0, n) on all hardware threads
+template <class F>
+void ParallelFor(unsigned int n, unsigned int grain, F body)
+{
+	unsigned int nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), n / grain));
+	if (nThreads == 1)
+	{
+		TRACE_SCOPE("ParallelFor");
+		body(0, n, 0);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < nThreads; t++)
+		threads.push_back(std::thread([&body, n, nThreads, t]()
+									  {
+										  TRACE_SCOPE("ParallelFor");
+										  body(n * t / nThreads, n * (t + 1) / nThreads, t);
+									  }));
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+//---------------------------
+class Profiler
+{ // named CPU and GPU zones summed per frame, rolling percentiles of the last frames
+	//---------------------------
+	static const int history = 128; // frames kept for the percentiles
+	typedef std::chrono::high_resolution_clock Clock;
+
+	struct Zone
+	{
+		std::string name;
+		float cpu = 0, gpu = 0;						 // milliseconds in the current frame
+		float cpuHistory[history] = {}, gpuHistory[history] = {};
+		unsigned int gpuSamples = 0;				 // in gpuHistory, frames whose results were not available yet are left out
+		bool gpuRead = false;						 // a result was added to gpu in the current frame
+		Clock::time_point start;
+		unsigned int queries[2] = {0, 0};			 // double buffered, the result of the previous frame is read
+		bool pending[2] = {false, false}, timed = false;
+	};
+	std::vector<Zone> zones;
+	unsigned int frame = 0;
+
+	unsigned int overlayVao = 0, overlayVbo = 0;
+	GPUProgram *overlayProgram = nullptr;
+	std::vector<vec2> overlayVertices;
+
+	float Percentile(const float *samples, unsigned int count, float p)
+	{
+		int n = std::min<unsigned int>(count, history);
+		if (n == 0)
+			return 0;
+		std::vector<float> sorted(samples, samples + n);
+		int k = std::min(n - 1, (int)(p * n));
+		std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+		return sorted[k];
+	}
+
+	// 3x5 pixel font from ' ' to 'Z', one octal digit per row from the top, the highest bit is the left column
+	void Text(const char *text, float x, float y, float pixel)
+	{
+		static const unsigned short font[] = {
+			000000, 022202, 055000, 057575, 036736, 051245, 025253, 022000, 012221, 042224, 005250, 002720, 000024, 000700, 000002, 011244,
+			075557, 026222, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717, 002020, 002024, 012421, 007070, 042124, 071202,
+			075547, 025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011153, 055655, 044447, 057755, 065555, 025552,
+			065644, 025563, 065655, 034216, 072222, 055557, 055552, 055775, 055255, 055222, 071247};
+		for (; *text; text++, x += 4 * pixel)
+		{
+			int c = toupper(*text);
+			if (c < ' ' || c > 'Z')
+				continue;
+			for (int row = 0; row < 5; row++)
+				for (int col = 0; col < 3; col++)
+					if (font[c - ' '] >> (3 * (4 - row) + 2 - col) & 1)
+					{
+						vec2 p0(x + col * pixel, y - (row + 1) * pixel), p1 = p0 + vec2(pixel, pixel);
+						overlayVertices.insert(overlayVertices.end(), {p0, vec2(p1.x, p0.y), p1, p0, p1, vec2(p0.x, p1.y)});
+					}
+		}
+	}
+
+public:
+	bool enabled = false;
+
+	int AddZone(const char *name) // index of the zone, to be cached by the caller
+	{
+		for (unsigned int i = 0; i < zones.size(); i++)
+			if (zones[i].name == name)
+				return i;
+		zones.push_back(Zone());
+		zones.back().name = name;
+		return zones.size() - 1;
+	}
+
+	void BeginCpu(int zone) { zones[zone].start = Clock::now(); }
+	void EndCpu(int zone)
+	{
+		zones[zone].cpu += std::chrono::duration<float, std::milli>(Clock::now() - zones[zone].start).count();
+	}
+
+	// time elapsed queries cannot be nested, gpu zones must follow each other
+	void BeginGpu(int zone)
+	{
+		Zone &z = zones[zone];
+		unsigned int slot = frame & 1;
+		if (z.queries[slot] == 0)
+			glGenQueries(2, z.queries);
+		if (z.pending[slot])
+		{ // issued two frames ago, skipped rather than waited for if the gpu is still behind
+			TRACE_SCOPE("glGetQueryObject");
+			int available = 0;
+			glGetQueryObjectiv(z.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available)
+			{
+				GLuint64 ns = 0;
+				glGetQueryObjectui64v(z.queries[slot], GL_QUERY_RESULT, &ns);
+				z.gpu += ns / 1e6f;
+				z.gpuRead = true;
+			}
+		}
+		glBeginQuery(GL_TIME_ELAPSED, z.queries[slot]);
+		z.pending[slot] = true;
+		z.timed = true;
+	}
+	void EndGpu()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+	}
+
+	void EndFrame()
+	{
+		unsigned int slot = frame % history;
+		for (Zone &z : zones)
+		{
+			z.cpuHistory[slot] = z.cpu;
+			if (z.gpuRead)
+				z.gpuHistory[z.gpuSamples++ % history] = z.gpu;
+			z.cpu = z.gpu = 0;
+			z.gpuRead = false;
+		}
+		frame++;
+	}
+
+	void Report(std::vector<std::string> &lines)
+	{
+		char line[128];
+		lines.push_back("ZONE         P50/P95/P99 MS");
+		for (Zone &z : zones)
+		{
+			snprintf(line, sizeof(line), "%-10s CPU %.2f/%.2f/%.2f", z.name.c_str(),
+					 Percentile(z.cpuHistory, frame, 0.5f), Percentile(z.cpuHistory, frame, 0.95f), Percentile(z.cpuHistory, frame, 0.99f));
+			lines.push_back(line);
+			if (z.timed)
+			{
+				snprintf(line, sizeof(line), "%-10s GPU %.2f/%.2f/%.2f", "",
+						 Percentile(z.gpuHistory, z.gpuSamples, 0.5f), Percentile(z.gpuHistory, z.gpuSamples, 0.95f), Percentile(z.gpuHistory, z.gpuSamples, 0.99f));
+				lines.push_back(line);
+			}
+		}
+	}
+
+	// text in the upper left corner of the viewport, on top of the scene
+	void DrawOverlay()
+	{
+		if (!overlayProgram)
+		{
+			const char *vertexSource = R"(
+				#version 330
+				layout(location = 0) in vec2 vertexPosition; // normalized device space
+				void main() { gl_Position = vec4(vertexPosition, 0, 1); }
+			)";
+			const char *fragmentSource = R"(
+				#version 330
+				out vec4 fragmentColor;
+				void main() { fragmentColor = vec4(1, 1, 0.6, 1); }
+			)";
+			overlayProgram = new GPUProgram();
+			overlayProgram->create(vertexSource, fragmentSource, "fragmentColor");
+			glGenVertexArrays(1, &overlayVao);
+			glBindVertexArray(overlayVao);
+			glGenBuffers(1, &overlayVbo);
+			glBindBuffer(GL_ARRAY_BUFFER, overlayVbo);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(vec2), NULL);
+		}
+		std::vector<std::string> lines;
+		Report(lines);
+		overlayVertices.clear();
+		float pixel = 4.0f / screenHeight; // 2 screen pixels per font pixel
+		for (unsigned int i = 0; i < lines.size(); i++)
+			Text(lines[i].c_str(), -0.98f, 0.98f - i * 7 * pixel, pixel);
+
+		overlayProgram->Use();
+		glBindVertexArray(overlayVao);
+		glBindBuffer(GL_ARRAY_BUFFER, overlayVbo);
+		glBufferData(GL_ARRAY_BUFFER, overlayVertices.size() * sizeof(vec2), &overlayVertices[0], GL_STREAM_DRAW);
+		glDisable(GL_DEPTH_TEST);
+		glDrawArrays(GL_TRIANGLES, 0, overlayVertices.size());
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	// the queries and the overlay, the zones and their history are kept
+	void Release()
+	{
+		for (Zone &z : zones)
+			if (z.queries[0])
+			{
+				glDeleteQueries(2, z.queries);
+				z.queries[0] = z.queries[1] = 0;
+				z.pending[0] = z.pending[1] = false;
+			}
+		if (overlayProgram)
+		{
+			delete overlayProgram;
+			overlayProgram = nullptr;
+			glDeleteVertexArrays(1, &overlayVao);
+			glDeleteBuffers(1, &overlayVbo);
+			overlayVao = overlayVbo = 0;
+		}
+	}
+};
+
+Profiler profiler;
+
+//---------------------------
+struct ProfileScope
+{ // CPU zone, optionally with a GPU timer query, for the lifetime of the object
+	//---------------------------
+	int zone;
+	bool gpu, active;
+	ProfileScope(int _zone, bool _gpu = false) : zone(_zone), gpu(_gpu), active(profiler.enabled)
+	{
+		if (!active)
+			return;
+		profiler.BeginCpu(zone);
+		if (gpu)
+			profiler.BeginGpu(zone);
+	}
+	~ProfileScope()
+	{
+		if (!active)
+			return;
+		if (gpu)
+			profiler.EndGpu();
+		profiler.EndCpu(zone);
+	}
+};
 
 vec3 height(float x, float y)
 {
@@ -91,6 +564,17 @@ public:
 												   0, 0, 0, 1);
 	}
 
+	// world space ray through a pixel, unprojected with the view and projection matrices
+	void Ray(int pX, int pY, vec3 &origin, vec3 &dir)
+	{
+		mat4 view = V(), proj = P();
+		float x = (2.0f * (pX + 0.5f) / screenWidth - 1) / proj[0][0];
+		float y = (1 - 2.0f * (pY + 0.5f) / screenHeight) / proj[1][1];
+		vec3 u(view[0][0], view[1][0], view[2][0]), v(view[0][1], view[1][1], view[2][1]), w(view[0][2], view[1][2], view[2][2]);
+		origin = wEye;
+		dir = normalize(u * x + v * y - w);
+	}
+
 	mat4 P()
 	{ // projection matrix
 		return mat4(1 / (tan(fov / 2) * asp), 0, 0, 0,
@@ -115,6 +599,7 @@ struct Light
 	vec3 La, Le, rotationAxis;
 	vec4 wLightPos; // homogeneous coordinates, can be at ideal point
 	float rotationAngle;
+	float range = 0; // point lights fade out to zero at this distance, 0: unbounded
 	virtual void Animate(float tstart, float tend)
 	{
 		rotationAngle = 0.8f * tend;
@@ -124,6 +609,280 @@ struct Light
 	}
 };
 
+//---------------------------
+class TextureCache
+{ // BC1 (S3TC) mip chains encoded on all cores, cached on disk keyed by the hash of the texels, RGBA8 where BC1 is missing
+	//---------------------------
+	static const unsigned int version = 1; // of the encoder and the file layout, part of the key
+	int supported = -1;					   // of the format by the context, -1: not queried yet
+
+	struct Level
+	{
+		int width, height;
+		std::vector<unsigned char> data; // rgba8 texels or BC1 blocks
+	};
+
+	static unsigned long long Hash(const std::vector<unsigned char> &rgba, int width, int height)
+	{ // FNV-1a
+		unsigned long long h = 14695981039346656037ull;
+		auto add = [&h](unsigned char byte)
+		{ h = (h ^ byte) * 1099511628211ull; };
+		for (unsigned int value : {version, (unsigned int)width, (unsigned int)height})
+			for (int i = 0; i < 4; i++)
+				add((value >> (8 * i)) & 0xff);
+		for (unsigned char byte : rgba)
+			add(byte);
+		return h;
+	}
+
+	// box filtered halvings down to 1x1, odd sizes repeat the last row or column
+	static std::vector<Level> MipChain(const std::vector<unsigned char> &rgba, int width, int height)
+	{
+		std::vector<Level> levels(1);
+		levels[0] = {width, height, rgba};
+		while (levels.back().width > 1 || levels.back().height > 1)
+		{
+			const Level &src = levels.back();
+			Level dst = {std::max(1, src.width / 2), std::max(1, src.height / 2), {}};
+			dst.data.resize((size_t)dst.width * dst.height * 4);
+			for (int y = 0; y < dst.height; y++)
+				for (int x = 0; x < dst.width; x++)
+					for (int c = 0; c < 4; c++)
+					{
+						int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+						int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+						int sum = src.data[(y0 * src.width + x0) * 4 + c] + src.data[(y0 * src.width + x1) * 4 + c] +
+								  src.data[(y1 * src.width + x0) * 4 + c] + src.data[(y1 * src.width + x1) * 4 + c];
+						dst.data[(y * dst.width + x) * 4 + c] = (sum + 2) / 4;
+					}
+			levels.push_back(dst);
+		}
+		return levels;
+	}
+
+	static unsigned short Pack565(const vec3 &c)
+	{
+		int r = (int)(std::min(std::max(c.x, 0.0f), 255.0f) * 31 / 255 + 0.5f), g = (int)(std::min(std::max(c.y, 0.0f), 255.0f) * 63 / 255 + 0.5f),
+			b = (int)(std::min(std::max(c.z, 0.0f), 255.0f) * 31 / 255 + 0.5f);
+		return (unsigned short)(r << 11 | g << 5 | b);
+	}
+
+	static vec3 Unpack565(unsigned short c)
+	{
+		int r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+		return vec3((float)(r << 3 | r >> 2), (float)(g << 2 | g >> 4), (float)(b << 3 | b >> 2));
+	}
+
+	// endpoints at the extremes of the texels along their principal axis, each texel takes the nearest of the 4 palette colors
+	static void EncodeBlock(const vec3 texels[16], unsigned char *block)
+	{
+		vec3 mean(0, 0, 0);
+		for (int i = 0; i < 16; i++)
+			mean = mean + texels[i];
+		mean = mean / 16;
+		float cov[6] = {0, 0, 0, 0, 0, 0}; // xx, xy, xz, yy, yz, zz
+		for (int i = 0; i < 16; i++)
+		{
+			vec3 d = texels[i] - mean;
+			cov[0] += d.x * d.x, cov[1] += d.x * d.y, cov[2] += d.x * d.z;
+			cov[3] += d.y * d.y, cov[4] += d.y * d.z, cov[5] += d.z * d.z;
+		}
+		vec3 axis(1, 1, 1);
+		for (int k = 0; k < 8; k++)
+		{ // power iteration
+			axis = vec3(cov[0] * axis.x + cov[1] * axis.y + cov[2] * axis.z,
+						cov[1] * axis.x + cov[3] * axis.y + cov[4] * axis.z,
+						cov[2] * axis.x + cov[4] * axis.y + cov[5] * axis.z);
+			float len = length(axis);
+			if (len < 1e-6f)
+				break; // one color
+			axis = axis / len;
+		}
+		float lo = 0, hi = 0;
+		for (int i = 0; i < 16; i++)
+		{
+			float t = dot(texels[i] - mean, axis);
+			lo = fminf(lo, t);
+			hi = fmaxf(hi, t);
+		}
+		unsigned short c0 = Pack565(mean + axis * hi), c1 = Pack565(mean + axis * lo);
+		if (c0 < c1)
+			std::swap(c0, c1); // c0 > c1 selects the 4 color mode
+		vec3 palette[4] = {Unpack565(c0), Unpack565(c1)};
+		palette[2] = (palette[0] * 2 + palette[1]) / 3;
+		palette[3] = (palette[0] + palette[1] * 2) / 3;
+		unsigned int indices = 0;
+		if (c0 != c1)
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0;
+				float bestDistance = INFINITY;
+				for (int p = 0; p < 4; p++)
+				{
+					vec3 d = texels[i] - palette[p];
+					float distance = dot(d, d);
+					if (distance < bestDistance)
+					{
+						bestDistance = distance;
+						best = p;
+					}
+				}
+				indices |= best << (2 * i);
+			}
+		block[0] = c0 & 0xff, block[1] = c0 >> 8, block[2] = c1 & 0xff, block[3] = c1 >> 8; // little endian
+		for (int i = 0; i < 4; i++)
+			block[4 + i] = (indices >> (8 * i)) & 0xff;
+	}
+
+	// 8 bytes per 4x4 block, the blocks over the edge repeat the last row or column, rows of blocks are shared out to the threads
+	static void Encode(const Level &src, Level &dst)
+	{
+		int bx = (src.width + 3) / 4, by = (src.height + 3) / 4;
+		dst.width = src.width;
+		dst.height = src.height;
+		dst.data.resize((size_t)bx * by * 8);
+		ParallelFor(by, 4, [&src, &dst, bx](unsigned int first, unsigned int last, unsigned int thread)
+					{
+						vec3 texels[16];
+						for (unsigned int j = first; j < last; j++)
+							for (int i = 0; i < bx; i++)
+							{
+								for (int k = 0; k < 16; k++)
+								{
+									int x = std::min(4 * i + k % 4, src.width - 1), y = std::min(4 * (int)j + k / 4, src.height - 1);
+									const unsigned char *t = &src.data[(y * src.width + x) * 4];
+									texels[k] = vec3(t[0], t[1], t[2]);
+								}
+								EncodeBlock(texels, &dst.data[(j * bx + i) * 8]);
+							}
+					});
+	}
+
+	std::string CachePath(unsigned long long hash)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.bc1", hash);
+		return directory + "/" + name;
+	}
+
+	// header: magic, version, width, height, level count, then the blocks of each level
+	bool Load(const std::string &path, int width, int height, std::vector<Level> &levels)
+	{
+		FILE *file = fopen(path.c_str(), "rb");
+		if (!file)
+			return false;
+		unsigned int header[5];
+		bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == 0x43314342 && header[1] == version &&
+				  (int)header[2] == width && (int)header[3] == height && header[4] > 0 && header[4] <= 32;
+		levels.resize(ok ? header[4] : 0);
+		for (unsigned int l = 0; ok && l < levels.size(); l++)
+		{
+			levels[l].width = std::max(1, width >> l);
+			levels[l].height = std::max(1, height >> l);
+			levels[l].data.resize((size_t)((levels[l].width + 3) / 4) * ((levels[l].height + 3) / 4) * 8);
+			ok = fread(&levels[l].data[0], 1, levels[l].data.size(), file) == levels[l].data.size();
+		}
+		fclose(file);
+		return ok;
+	}
+
+	void Save(const std::string &path, int width, int height, const std::vector<Level> &levels)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		std::string temporary = path + ".tmp"; // renamed when complete, a concurrent or aborted run never leaves half a file
+		FILE *file = fopen(temporary.c_str(), "wb");
+		if (!file)
+		{
+			printf("Cannot write the texture cache %s\n", path.c_str());
+			return;
+		}
+		unsigned int header[5] = {0x43314342, version, (unsigned int)width, (unsigned int)height, (unsigned int)levels.size()}; // "BC1C"
+		fwrite(header, sizeof(header), 1, file);
+		for (const Level &level : levels)
+			fwrite(&level.data[0], 1, level.data.size(), file);
+		fclose(file);
+		std::filesystem::rename(temporary, path, error);
+	}
+
+	bool Supported()
+	{
+		if (supported < 0)
+		{
+			supported = 0;
+			const char *env = getenv("TEXTURE_COMPRESSION");
+			int n = 0;
+			glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+			for (int i = 0; i < n && !(env && atoi(env) == 0); i++)
+				if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_EXT_texture_compression_s3tc") == 0)
+					supported = 1;
+			if (!supported)
+				printf("Textures are uncompressed, BC1 is %s\n", env && atoi(env) == 0 ? "off" : "not supported");
+		}
+		return supported == 1;
+	}
+
+public:
+	std::string directory = getenv("TEXTURE_CACHE") ? getenv("TEXTURE_CACHE") : "texture_cache"; // TEXTURE_CACHE=<dir>
+	size_t bytes = 0, uncompressedBytes = 0; // of the mip chains created so far, as uploaded and as RGBA8
+
+	// mipmapped texture from the image, sampling is the magnification filter, minification uses the nearest or linear mip levels
+	void Create(Texture &texture, const char *name, int width, int height, const std::vector<vec4> &image, int sampling)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<unsigned char> rgba((size_t)width * height * 4);
+		for (size_t i = 0; i < image.size(); i++)
+			for (int c = 0; c < 4; c++)
+				rgba[4 * i + c] = (unsigned char)(std::min(std::max((&image[i].x)[c], 0.0f), 1.0f) * 255 + 0.5f); // fminf is a libm call
+		unsigned int nLevels = 1; // down to 1x1
+		for (int size = std::max(width, height); size > 1; size /= 2)
+			nLevels++;
+		std::vector<Level> levels;
+		bool compressed = Supported(), cached = false;
+		if (compressed)
+		{
+			std::string path = CachePath(Hash(rgba, width, height));
+			cached = Load(path, width, height, levels) && levels.size() == nLevels;
+			if (!cached)
+			{
+				std::vector<Level> chain = MipChain(rgba, width, height);
+				levels.resize(chain.size());
+				for (unsigned int l = 0; l < chain.size(); l++)
+					Encode(chain[l], levels[l]);
+				Save(path, width, height, levels);
+			}
+		}
+		else
+			levels = MipChain(rgba, width, height);
+
+		if (texture.textureId == 0)
+			glGenTextures(1, &texture.textureId);
+		glBindTexture(GL_TEXTURE_2D, texture.textureId);
+		size_t textureBytes = 0, rgbaBytes = 0;
+		for (unsigned int l = 0; l < levels.size(); l++)
+		{
+			const Level &level = levels[l];
+			if (compressed)
+				glCompressedTexImage2D(GL_TEXTURE_2D, l, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, level.width, level.height, 0, level.data.size(), &level.data[0]);
+			else
+				glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA8, level.width, level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &level.data[0]);
+			textureBytes += level.data.size();
+			rgbaBytes += (size_t)level.width * level.height * 4;
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels.size() - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling == GL_NEAREST ? GL_NEAREST_MIPMAP_NEAREST : GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
+		bytes += textureBytes;
+		uncompressedBytes += rgbaBytes;
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		printf("%s texture %dx%d: %s, %u levels, %.1f KB instead of %.1f KB as RGBA8, %s in %.1f ms (textures %.1f KB saved)\n", name, width, height,
+			   compressed ? "BC1" : "RGBA8", (unsigned int)levels.size(), textureBytes / 1024.0, rgbaBytes / 1024.0,
+			   !compressed ? "uploaded" : cached ? "from the cache" : "encoded", ms, (uncompressedBytes - bytes) / 1024.0);
+	}
+};
+
+TextureCache textureCache;
+
 //---------------------------
 class CheckerBoardTexture : public Texture
 {
@@ -138,7 +897,8 @@ public:
 			{
 				image[y * width + x] = (x & 1) ^ (y & 1) ? yellow : blue;
 			}
-		create(width, height, image, GL_NEAREST);
+		TRACE_SCOPE("create CheckerBoardTexture");
+		textureCache.Create(*this, "CheckerBoard", width, height, image, GL_NEAREST);
 	}
 };
 
@@ -157,66 +917,341 @@ public:
 				image[y * width + x] = vec4(float((x * x + y * y) % 30000) / 30000, float((x * x + y * y) % 30000) / 300000, 1, 1);
 				//image[y * width + x] = (x & 1) ^ (y & 1) ? yellow : blue;
 			}
-		create(width, height, image, GL_NEAREST);
+		TRACE_SCOPE("create BowlTexture");
+		textureCache.Create(*this, "Bowl", width, height, image, GL_NEAREST);
 	}
 };
 
 //---------------------------
-struct RenderState
-{
+class LightGrid
+{ // tiled forward shading: the lights reaching each screen tile are listed once per frame, the shaders loop over the list of their tile
 	//---------------------------
-	mat4 MVP, M, Minv, V, P;
-	Material *material;
+	std::vector<vec4> data; // La and range, Le, wLightPos per light
+	std::vector<int> tiles; // first index and count per tile, followed by the light indices of the tiles
+	std::vector<int> rects; // x0, y0, x1, y1 tile range per light
+	unsigned int dataBuffer = 0, tileBuffer = 0;
+
+	// conservative tile range of the screen rectangle of a light, the bounding box of the sphere in view space is projected
+	void Rect(const Light &light, const mat4 &V, const mat4 &P, int *rect)
+	{
+		rect[0] = rect[1] = 0;
+		rect[2] = tilesX - 1;
+		rect[3] = tilesY - 1;
+		if (light.range <= 0 || light.wLightPos.w == 0)
+			return;
+		vec4 p = light.wLightPos * V;
+		vec3 center = vec3(p.x, p.y, p.z) / p.w;
+		float r = light.range, d = -center.z; // distance in front of the camera
+		if (d - r <= 1e-3f)
+			return; // crosses the eye plane
+		float lo[2], hi[2];
+		for (int axis = 0; axis < 2; axis++)
+		{
+			float c = axis == 0 ? center.x : center.y, scale = P[axis][axis];
+			lo[axis] = scale * (c - r) / (c - r < 0 ? d - r : d + r);
+			hi[axis] = scale * (c + r) / (c + r > 0 ? d - r : d + r);
+		}
+		rect[0] = std::max(0, (int)floorf((lo[0] * 0.5f + 0.5f) * width / tileSize));
+		rect[1] = std::max(0, (int)floorf((lo[1] * 0.5f + 0.5f) * height / tileSize));
+		rect[2] = std::min(tilesX - 1, (int)floorf((hi[0] * 0.5f + 0.5f) * width / tileSize));
+		rect[3] = std::min(tilesY - 1, (int)floorf((hi[1] * 0.5f + 0.5f) * height / tileSize));
+	}
+
+public:
+	static const int windowTileSize = 32; // pixels at the window resolution, reduced resolutions use proportionally smaller tiles
+	int tileSize = windowTileSize, width = 0, height = 0, tilesX = 0, tilesY = 0;
+	int nLights = 0; // in dataTexture, a vertex outside the screen has no tile and loops over all of them
+	unsigned int dataTexture = 0, tileTexture = 0;
+	int maxPerTile = 0, total = 0; // statistics of the last build
+
+	// the vectors keep their capacity, the steady state does not allocate
+	void Build(const std::vector<Light> &lights, const mat4 &V, const mat4 &P, int _width, int _height, int _tileSize = windowTileSize)
+	{
+		width = _width;
+		height = _height;
+		tileSize = _tileSize;
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		int nTiles = tilesX * tilesY;
+		nLights = (int)lights.size();
+		data.resize(3 * lights.size());
+		rects.resize(4 * lights.size());
+		tiles.assign(2 * nTiles, 0);
+		for (unsigned int i = 0; i < lights.size(); i++)
+		{
+			const Light &light = lights[i];
+			data[3 * i] = vec4(light.La.x, light.La.y, light.La.z, light.range);
+			data[3 * i + 1] = vec4(light.Le.x, light.Le.y, light.Le.z, 0);
+			data[3 * i + 2] = light.wLightPos;
+			int *rect = &rects[4 * i];
+			Rect(light, V, P, rect);
+			for (int y = rect[1]; y <= rect[3]; y++)
+				for (int x = rect[0]; x <= rect[2]; x++)
+					tiles[2 * (y * tilesX + x) + 1]++;
+		}
+		total = maxPerTile = 0;
+		for (int t = 0; t < nTiles; t++)
+		{
+			tiles[2 * t] = 2 * nTiles + total;
+			total += tiles[2 * t + 1];
+			maxPerTile = std::max(maxPerTile, tiles[2 * t + 1]);
+			tiles[2 * t + 1] = 0; // counts again while filling
+		}
+		tiles.resize(2 * nTiles + total);
+		for (unsigned int i = 0; i < lights.size(); i++)
+		{
+			const int *rect = &rects[4 * i];
+			for (int y = rect[1]; y <= rect[3]; y++)
+				for (int x = rect[0]; x <= rect[2]; x++)
+				{
+					int t = y * tilesX + x;
+					tiles[tiles[2 * t] + tiles[2 * t + 1]++] = i;
+				}
+		}
+	}
+
+	// buffer textures, read with texelFetch in the shaders
+	void Upload()
+	{
+		if (!dataBuffer)
+		{
+			glGenBuffers(1, &dataBuffer);
+			glGenBuffers(1, &tileBuffer);
+			glGenTextures(1, &dataTexture);
+			glGenTextures(1, &tileTexture);
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, dataBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, data.size() * sizeof(vec4), &data[0], GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, tileBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, tiles.size() * sizeof(int), &tiles[0], GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_BUFFER, dataTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, dataBuffer);
+		glBindTexture(GL_TEXTURE_BUFFER, tileTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, tileBuffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+
+	void Release()
+	{
+		if (!dataBuffer)
+			return;
+		glDeleteTextures(1, &dataTexture);
+		glDeleteTextures(1, &tileTexture);
+		glDeleteBuffers(1, &dataBuffer);
+		glDeleteBuffers(1, &tileBuffer);
+		dataBuffer = tileBuffer = dataTexture = tileTexture = 0;
+	}
+};
+
+//---------------------------
+struct FrameState
+{ // the same for every draw of a frame, built once in Scene::Render
+	//---------------------------
+	mat4 V, P, VP;
+	vec3 wEye;
+	int width, height; // of the render target in pixels
 	std::vector<Light> lights;
+	const LightGrid *lightGrid; // per tile light lists of the lights
+};
+
+//---------------------------
+struct DrawState
+{ // per object, lives on the stack of Object::Draw
+	//---------------------------
+	mat4 MVP, M, Minv;
+	Material *material;
 	Texture *texture;
-	vec3 wEye;
+	vec3 posScale, posBias; // dequantization of the vertex positions
+	bool octNormals;		// normals are octahedral encoded
+	int surfaceType;		// procedural surface evaluated in the vertex shader, 0: vertex buffer
+	vec2 surfaceTess;
+	const vec3 *mirrors;	// reflections of the object drawn as instances, nullptr: drawn once
+	int nMirrors;
+	int batchSize;				  // objects drawn by the call, above 1 their transforms are in the instance texture
+	int batchFirst;				  // object of the batch in the instance texture
+	unsigned int instanceTexture; // buffer texture of the M and Minv rows of the batched objects
 };
 
 //---------------------------
 class Shader : public GPUProgram
 {
 	//---------------------------
+	std::map<std::string, int, std::less<>> locations; // filled at the first binds
+
+	// the transparent comparison finds the name without building a string, the binds of the steady state do not allocate
+	int location(const char *name)
+	{
+		auto l = locations.find(name);
+		if (l != locations.end())
+			return l->second;
+		int loc = glGetUniformLocation(getId(), name);
+		if (loc < 0)
+			printf("uniform %s cannot be set\n", name);
+		locations.emplace(name, loc);
+		return loc;
+	}
+
 public:
-	virtual void Bind(RenderState state) = 0;
+	virtual void Bind(const FrameState &frame, const DrawState &draw) = 0;
+	virtual bool Batches() { return false; } // draws several objects with one call, see DrawState::batchSize
 
-	void setUniformMaterial(const Material &material, const std::string &name)
+	using GPUProgram::setUniform; // glUniform with location -1 is ignored like the framework does
+	void setUniform(int i, const char *name) { glUniform1i(location(name), i); }
+	void setUniform(float f, const char *name) { glUniform1f(location(name), f); }
+	void setUniform(const vec2 &v, const char *name) { glUniform2fv(location(name), 1, &v.x); }
+	void setUniform(const vec3 &v, const char *name) { glUniform3fv(location(name), 1, &v.x); }
+	void setUniform(const vec4 &v, const char *name) { glUniform4fv(location(name), 1, &v.x); }
+	void setUniform(const mat4 &mat, const char *name) { glUniformMatrix4fv(location(name), 1, GL_TRUE, mat); }
+	void setUniform(const Texture &texture, const char *samplerName, unsigned int textureUnit = 0)
 	{
-		setUniform(material.kd, name + ".kd");
-		setUniform(material.ks, name + ".ks");
-		setUniform(material.ka, name + ".ka");
-		setUniform(material.shininess, name + ".shininess");
+		int loc = location(samplerName);
+		if (loc >= 0)
+		{
+			glUniform1i(loc, textureUnit);
+			glActiveTexture(GL_TEXTURE0 + textureUnit);
+			glBindTexture(GL_TEXTURE_2D, texture.textureId);
+		}
 	}
 
-	void setUniformLight(const Light &light, const std::string &name)
+	void setUniformMaterial(const Material &material)
 	{
-		setUniform(light.La, name + ".La");
-		setUniform(light.Le, name + ".Le");
-		setUniform(light.wLightPos, name + ".wLightPos");
+		setUniform(material.kd, "material.kd");
+		setUniform(material.ks, "material.ks");
+		setUniform(material.ka, "material.ka");
+		setUniform(material.shininess, "material.shininess");
 	}
-};
 
-//---------------------------
-class GouraudShader : public Shader
-{
-	//---------------------------
-	const char *vertexSource = R"(
-		#version 330
-		precision highp float;
+	// GLSL of the tiled lights for either stage, the uniforms are set by setUniformLights
+	const char *lightSource = R"(
+		uniform samplerBuffer  lightData;  // 3 texels per light: La and range, Le, wLightPos
+		uniform isamplerBuffer lightTiles; // first index and count per screen tile, then the light indices
+		uniform int   tileSize, tilesX;
 
-		struct Light {
-			vec3 La, Le;
-			vec4 wLightPos;
-		};
-		
-		struct Material {
-			vec3 kd, ks, ka;
-			float shininess;
-		};
+		// Blinn-Phong radiance of light i at the homogeneous world position
+		vec3 lightRadiance(int i, vec4 wPos, vec3 N, vec3 V, vec3 ka, vec3 kd, vec3 ks, float shininess) {
+			vec4 La = texelFetch(lightData, 3 * i), Le = texelFetch(lightData, 3 * i + 1), wLightPos = texelFetch(lightData, 3 * i + 2);
+			vec3 wLight = wLightPos.xyz * wPos.w - wPos.xyz * wLightPos.w;
+			float attenuation = La.w > 0 ? pow(max(1 - dot(wLight, wLight) / (La.w * La.w), 0), 2) : 1; // La.w: range of point lights
+			vec3 L = normalize(wLight);
+			vec3 H = normalize(L + V);
+			float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
+			return (ka * La.rgb + (kd * cost + ks * pow(cosd, shininess)) * Le.rgb) * attenuation;
+		}
+
+		// sum over the lights listed for the screen tile
+		vec3 tileRadiance(ivec2 tile, vec4 wPos, vec3 N, vec3 V, vec3 ka, vec3 kd, vec3 ks, float shininess) {
+			vec3 radiance = vec3(0, 0, 0);
+			int t = 2 * (tile.y * tilesX + tile.x);
+			int first = texelFetch(lightTiles, t).r, count = texelFetch(lightTiles, t + 1).r;
+			for(int k = 0; k < count; k++)
+				radiance += lightRadiance(texelFetch(lightTiles, first + k).r, wPos, N, V, ka, kd, ks, shininess);
+			return radiance;
+		}
+	)";
+
+	// the light lists are on texture units 1 and 2, unit 0 is left to the diffuse texture
+	void setUniformLights(const LightGrid &grid)
+	{
+		setUniform(1, "lightData");
+		setUniform(2, "lightTiles");
+		setUniform(grid.tileSize, "tileSize");
+		setUniform(grid.tilesX, "tilesX");
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_BUFFER, grid.dataTexture);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_BUFFER, grid.tileTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	// GLSL of the vertex formats, the procedural surfaces and the mirrors for the vertex shaders, the uniforms are set by setUniformVertexFormat
+	const char *surfaceSource = R"(
+		uniform vec3  posScale, posBias; // dequantization of compact positions
+		uniform int   octNormals;       // normals are octahedral encoded
+		uniform int   surfaceType;      // procedural surface from gl_VertexID, 0: vertex buffer
+		uniform vec2  surfaceTess;      // procedural grid resolution in u and v
+		uniform vec3  mirrors[8];       // reflections drawn as instances, (1, 1, 1) without mirroring
+		uniform int   stripInstances;   // instances per mirror: the strips of procedural surfaces, otherwise 1
+
+		const float PI = 3.14159265;
+
+		// strip vertex k of instance i lies on grid line i + k % 2 at column k / 2
+		vec2 surfaceUV() {
+			return vec2(gl_VertexID / 2, gl_InstanceID % stripInstances + gl_VertexID % 2) / surfaceTess;
+		}
+
+		void surfaceEval(vec2 uv, out vec3 pos, out vec3 norm) {
+			vec3 drdu, drdv;
+			if (surfaceType == 1) {	// sphere
+				float U = uv.x * 2 * PI, V = uv.y * PI;
+				pos = vec3(cos(U) * sin(V), sin(U) * sin(V), cos(V));
+				drdu = 2 * PI * vec3(-sin(U) * sin(V), cos(U) * sin(V), 0);
+				drdv = PI * vec3(cos(U) * cos(V), sin(U) * cos(V), -sin(V));
+			} else {					// bowl quadrant
+				float r2 = dot(uv, uv);
+				pos = vec3(uv, cosh(r2));
+				drdu = vec3(1, 0, 2 * uv.x * sinh(r2));
+				drdv = vec3(0, 1, 2 * uv.y * sinh(r2));
+			}
+			norm = cross(drdu, drdv);
+		}
+
+		vec3 octDecode(vec2 e) {
+			vec3 n = vec3(e, 1 - abs(e.x) - abs(e.y));
+			if (n.z < 0) n.xy = (1 - abs(n.yx)) * vec2(n.x >= 0 ? 1 : -1, n.y >= 0 ? 1 : -1);
+			return n;
+		}
+
+		// the reflection of the mirror of the instance, which is counted within the object
+		void mirrorInstance(int instance, inout vec3 pos, inout vec3 norm) {
+			vec3 mirror = mirrors[instance / stripInstances];
+			pos *= mirror;
+			norm *= mirror * (mirror.x * mirror.y * mirror.z); // cross(drdu, drdv) of the reflected surface
+		}
+	)";
+
+	// a stage of a shader: the version line, then the shared sources it uses and its own source
+	static std::string Source(std::initializer_list<const char *> parts)
+	{
+		std::string source = "#version 330\nprecision highp float;\n";
+		for (const char *part : parts)
+			source += part;
+		return source;
+	}
+
+	void setUniformVertexFormat(const DrawState &draw)
+	{
+		setUniform(draw.posScale, "posScale");
+		setUniform(draw.posBias, "posBias");
+		setUniform((int)draw.octNormals, "octNormals");
+		setUniform(draw.surfaceType, "surfaceType");
+		setUniform(draw.surfaceTess, "surfaceTess");
+		setUniform(draw.surfaceType != 0 ? (int)draw.surfaceTess.y : 1, "stripInstances");
+		static const vec3 identity(1, 1, 1);
+		glUniform3fv(location("mirrors"), draw.mirrors ? draw.nMirrors : 1, draw.mirrors ? &draw.mirrors[0].x : &identity.x);
+	}
+};
+
+//---------------------------
+class GouraudShader : public Shader
+{
+	//---------------------------
+	const char *vertexSource = R"(
+		struct Material {
+			vec3 kd, ks, ka;
+			float shininess;
+		};
 
 		uniform mat4  MVP, M, Minv;  // MVP, Model, Model-inverse
-		uniform Light[8] lights;     // light source direction 
-		uniform int   nLights;		 // number of light sources
+		uniform int   tilesY;
+		uniform int   nLights;         // all lights, for vertices without a tile
+		uniform vec2  viewport;        // in pixels
 		uniform vec3  wEye;          // pos of eye
+		uniform int   objectInstances;  // instances per object: mirrors times strips
+		uniform int   batchSize;        // objects of the draw, above 1 their M and Minv come from instanceData
+		uniform int   batchFirst;
+		uniform samplerBuffer instanceData; // 8 texels per object: the rows of M and Minv
+		uniform mat4  VP;
 		uniform Material  material;  // diffuse, specular, ambient ref
 
 		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
@@ -225,28 +1260,45 @@ class GouraudShader : public Shader
 		out vec3 radiance;		    // reflected radiance
 
 		void main() {
-			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+			vec3 pos, norm;
+			if (surfaceType != 0) {
+				surfaceEval(surfaceUV(), pos, norm);
+			} else {
+				pos = vtxPos * posScale + posBias;
+				norm = (octNormals != 0) ? octDecode(vtxNorm.xy) : vtxNorm;
+			}
+			mat4 Mo = M, Minvo = Minv, MVPo = MVP;
+			int instance = gl_InstanceID; // within the object
+			if (batchSize > 1) {
+				int o = 8 * (batchFirst + gl_InstanceID / objectInstances);
+				instance = gl_InstanceID % objectInstances;
+				Mo = transpose(mat4(texelFetch(instanceData, o), texelFetch(instanceData, o + 1), texelFetch(instanceData, o + 2), texelFetch(instanceData, o + 3)));
+				Minvo = transpose(mat4(texelFetch(instanceData, o + 4), texelFetch(instanceData, o + 5), texelFetch(instanceData, o + 6), texelFetch(instanceData, o + 7)));
+				MVPo = Mo * VP;
+			}
+			mirrorInstance(instance, pos, norm);
+			gl_Position = vec4(pos, 1) * MVPo; // to NDC
 			// radiance computation
-			vec4 wPos = vec4(vtxPos, 1) * M;	
+			vec4 wPos = vec4(pos, 1) * Mo;	
 			vec3 V = normalize(wEye * wPos.w - wPos.xyz);
-			vec3 N = normalize((Minv * vec4(vtxNorm, 0)).xyz);
+			vec3 N = normalize((Minvo * vec4(norm, 0)).xyz);
 			if (dot(N, V) < 0) N = -N;	// prepare for one-sided surfaces like Mobius or Klein
 
-			radiance = vec3(0, 0, 0);
-			for(int i = 0; i < nLights; i++) {
-				vec3 L = normalize(lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w);
-				vec3 H = normalize(L + V);
-				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
-				radiance += material.ka * lights[i].La + (material.kd * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le;
+			// lights of the tile of the vertex, all lights behind the eye or off the screen where its triangle may still be visible
+			vec2 ndc = gl_Position.xy / gl_Position.w;
+			if (gl_Position.w > 0 && all(lessThanEqual(abs(ndc), vec2(1, 1)))) {
+				ivec2 tile = clamp(ivec2((ndc * 0.5 + 0.5) * viewport) / tileSize, ivec2(0, 0), ivec2(tilesX - 1, tilesY - 1));
+				radiance = tileRadiance(tile, wPos, N, V, material.ka, material.kd, material.ks, material.shininess);
+			} else {
+				radiance = vec3(0, 0, 0);
+				for(int i = 0; i < nLights; i++)
+					radiance += lightRadiance(i, wPos, N, V, material.ka, material.kd, material.ks, material.shininess);
 			}
 		}
 	)";
 
 	// fragment shader in GLSL
 	const char *fragmentSource = R"(
-		#version 330
-		precision highp float;
-
 		in  vec3 radiance;      // interpolated radiance
 		out vec4 fragmentColor; // output goes to frame buffer
 
@@ -256,40 +1308,46 @@ class GouraudShader : public Shader
 	)";
 
 public:
-	GouraudShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+	GouraudShader()
+	{
+		TRACE_SCOPE("compile GouraudShader");
+		create(Source({surfaceSource, lightSource, vertexSource}).c_str(), Source({fragmentSource}).c_str(), "fragmentColor");
+	}
 
-	void Bind(RenderState state)
+	void Bind(const FrameState &frame, const DrawState &draw)
 	{
 		Use(); // make this program run
-		setUniform(state.MVP, "MVP");
-		setUniform(state.M, "M");
-		setUniform(state.Minv, "Minv");
-		setUniform(state.wEye, "wEye");
-		setUniformMaterial(*state.material, "material");
-
-		setUniform((int)state.lights.size(), "nLights");
-		for (unsigned int i = 0; i < state.lights.size(); i++)
-		{
-			setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
+		setUniform(draw.MVP, "MVP");
+		setUniform(draw.M, "M");
+		setUniform(draw.Minv, "Minv");
+		setUniform(frame.wEye, "wEye");
+		setUniformVertexFormat(draw);
+		setUniformMaterial(*draw.material);
+		setUniformLights(*frame.lightGrid);
+		setUniform(frame.lightGrid->tilesY, "tilesY"); // the tile is found from the clip position of the vertex
+		setUniform(frame.lightGrid->nLights, "nLights");
+		setUniform(vec2((float)frame.lightGrid->width, (float)frame.lightGrid->height), "viewport");
+		setUniform(std::max(1, draw.nMirrors) * (draw.surfaceType != 0 ? (int)draw.surfaceTess.y : 1), "objectInstances");
+		setUniform(draw.batchSize, "batchSize");
+		if (draw.batchSize > 1)
+		{ // unit 3, after the light lists
+			setUniform(draw.batchFirst, "batchFirst");
+			setUniform(frame.VP, "VP");
+			setUniform(3, "instanceData");
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_BUFFER, draw.instanceTexture);
+			glActiveTexture(GL_TEXTURE0);
 		}
 	}
+
+	bool Batches() { return true; }
 };
 
 class BowlShader : public Shader
 {
 	//---------------------------
 	const char *vertexSource = R"(
-		#version 330
-		precision highp float;
-
-		struct Light {
-			vec3 La, Le;
-			vec4 wLightPos;
-		};
-
 		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
-		uniform Light[8] lights;    // light sources 
-		uniform int   nLights;
 		uniform vec3  wEye;         // pos of eye
 
 		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
@@ -298,45 +1356,43 @@ class BowlShader : public Shader
 
 		out vec3 wNormal;		    // normal in world space
 		out vec3 wView;             // view in world space
-		out vec3 wLight[8];		    // light dir in world space
+		out vec3 wPosition;         // pos in world space
 		out vec2 texcoord;
 
 		void main() {
-			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
-			// vectors for radiance computation
-			vec4 wPos = vec4(vtxPos, 1) * M;
-			for(int i = 0; i < nLights; i++) {
-				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+			vec3 pos, norm;
+			vec2 uv = vtxUV;
+			if (surfaceType != 0) {
+				uv = surfaceUV();
+				surfaceEval(uv, pos, norm);
+			} else {
+				pos = vtxPos * posScale + posBias;
+				norm = (octNormals != 0) ? octDecode(vtxNorm.xy) : vtxNorm;
 			}
+			mirrorInstance(gl_InstanceID, pos, norm);
+			gl_Position = vec4(pos, 1) * MVP; // to NDC
+			// vectors for radiance computation
+			vec4 wPos = vec4(pos, 1) * M;
+			wPosition = wPos.xyz / wPos.w;
 		    wView  = wEye * wPos.w - wPos.xyz;
-		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
-		    texcoord = vtxUV;
+		    wNormal = (Minv * vec4(norm, 0)).xyz;
+		    texcoord = uv;
 		}
 	)";
 
 	// fragment shader in GLSL
 	const char *fragmentSource = R"(
-		#version 330
-		precision highp float;
-
-		struct Light {
-			vec3 La, Le;
-			vec4 wLightPos;
-		};
-
 		struct Material {
 			vec3 kd, ks, ka;
 			float shininess;
 		};
 
 		uniform Material material;
-		uniform Light[8] lights;    // light sources 
-		uniform int   nLights;
 		uniform sampler2D diffuseTexture;
 
 		in  vec3 wNormal;       // interpolated world sp normal
 		in  vec3 wView;         // interpolated world sp view
-		in  vec3 wLight[8];     // interpolated world sp illum dir
+		in  vec3 wPosition;     // interpolated world sp position
 		in  vec2 texcoord;
 		
         out vec4 fragmentColor; // output goes to frame buffer
@@ -349,37 +1405,30 @@ class BowlShader : public Shader
 			vec3 ka = material.ka * texColor;
 			vec3 kd = material.kd * texColor;
 
-			vec3 radiance = vec3(0, 0, 0);
-			for(int i = 0; i < nLights; i++) {
-				vec3 L = normalize(wLight[i]);
-				vec3 H = normalize(L + V);
-				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
-				// kd and ka are modulated by the texture
-				radiance += ka * lights[i].La + 
-                           (kd * texColor * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le;
-			}
+			// kd and ka are modulated by the texture
+			vec3 radiance = tileRadiance(ivec2(gl_FragCoord.xy) / tileSize, vec4(wPosition, 1), N, V, ka, kd * texColor, material.ks, material.shininess);
 			fragmentColor = vec4(radiance, 1);
 		}
 	)";
 
 public:
-	BowlShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+	BowlShader()
+	{
+		TRACE_SCOPE("compile BowlShader");
+		create(Source({surfaceSource, vertexSource}).c_str(), Source({lightSource, fragmentSource}).c_str(), "fragmentColor");
+	}
 
-	void Bind(RenderState state)
+	void Bind(const FrameState &frame, const DrawState &draw)
 	{
 		Use(); // make this program run
-		setUniform(state.MVP, "MVP");
-		setUniform(state.M, "M");
-		setUniform(state.Minv, "Minv");
-		setUniform(state.wEye, "wEye");
-		setUniform(*state.texture, std::string("diffuseTexture"));
-		setUniformMaterial(*state.material, "material");
-
-		setUniform((int)state.lights.size(), "nLights");
-		for (unsigned int i = 0; i < state.lights.size(); i++)
-		{
-			setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
-		}
+		setUniform(draw.MVP, "MVP");
+		setUniform(draw.M, "M");
+		setUniform(draw.Minv, "Minv");
+		setUniform(frame.wEye, "wEye");
+		setUniformVertexFormat(draw);
+		setUniform(*draw.texture, "diffuseTexture");
+		setUniformMaterial(*draw.material);
+		setUniformLights(*frame.lightGrid);
 	}
 };
 
@@ -388,17 +1437,7 @@ class PhongShader : public Shader
 {
 	//---------------------------
 	const char *vertexSource = R"(
-		#version 330
-		precision highp float;
-
-		struct Light {
-			vec3 La, Le;
-			vec4 wLightPos;
-		};
-
 		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
-		uniform Light[8] lights;    // light sources 
-		uniform int   nLights;
 		uniform vec3  wEye;         // pos of eye
 
 		layout(location = 0) in vec3  vtxPos;            // pos in modeling space
@@ -407,45 +1446,43 @@ class PhongShader : public Shader
 
 		out vec3 wNormal;		    // normal in world space
 		out vec3 wView;             // view in world space
-		out vec3 wLight[8];		    // light dir in world space
+		out vec3 wPosition;         // pos in world space
 		out vec2 texcoord;
 
 		void main() {
-			gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
-			// vectors for radiance computation
-			vec4 wPos = vec4(vtxPos, 1) * M;
-			for(int i = 0; i < nLights; i++) {
-				wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+			vec3 pos, norm;
+			vec2 uv = vtxUV;
+			if (surfaceType != 0) {
+				uv = surfaceUV();
+				surfaceEval(uv, pos, norm);
+			} else {
+				pos = vtxPos * posScale + posBias;
+				norm = (octNormals != 0) ? octDecode(vtxNorm.xy) : vtxNorm;
 			}
+			mirrorInstance(gl_InstanceID, pos, norm);
+			gl_Position = vec4(pos, 1) * MVP; // to NDC
+			// vectors for radiance computation
+			vec4 wPos = vec4(pos, 1) * M;
+			wPosition = wPos.xyz / wPos.w;
 		    wView  = wEye * wPos.w - wPos.xyz;
-		    wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
-		    texcoord = vtxUV;
+		    wNormal = (Minv * vec4(norm, 0)).xyz;
+		    texcoord = uv;
 		}
 	)";
 
 	// fragment shader in GLSL
 	const char *fragmentSource = R"(
-		#version 330
-		precision highp float;
-
-		struct Light {
-			vec3 La, Le;
-			vec4 wLightPos;
-		};
-
 		struct Material {
 			vec3 kd, ks, ka;
 			float shininess;
 		};
 
 		uniform Material material;
-		uniform Light[8] lights;    // light sources 
-		uniform int   nLights;
 		uniform sampler2D diffuseTexture;
 
 		in  vec3 wNormal;       // interpolated world sp normal
 		in  vec3 wView;         // interpolated world sp view
-		in  vec3 wLight[8];     // interpolated world sp illum dir
+		in  vec3 wPosition;     // interpolated world sp position
 		in  vec2 texcoord;
 		
         out vec4 fragmentColor; // output goes to frame buffer
@@ -458,37 +1495,30 @@ class PhongShader : public Shader
 			vec3 ka = material.ka * texColor;
 			vec3 kd = material.kd * texColor;
 
-			vec3 radiance = vec3(0, 0, 0);
-			for(int i = 0; i < nLights; i++) {
-				vec3 L = normalize(wLight[i]);
-				vec3 H = normalize(L + V);
-				float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
-				// kd and ka are modulated by the texture
-				radiance += ka * lights[i].La + 
-                           (kd * texColor * cost + material.ks * pow(cosd, material.shininess)) * lights[i].Le;
-			}
+			// kd and ka are modulated by the texture
+			vec3 radiance = tileRadiance(ivec2(gl_FragCoord.xy) / tileSize, vec4(wPosition, 1), N, V, ka, kd * texColor, material.ks, material.shininess);
 			fragmentColor = vec4(radiance, 1);
 		}
 	)";
 
 public:
-	PhongShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+	PhongShader()
+	{
+		TRACE_SCOPE("compile PhongShader");
+		create(Source({surfaceSource, vertexSource}).c_str(), Source({lightSource, fragmentSource}).c_str(), "fragmentColor");
+	}
 
-	void Bind(RenderState state)
+	void Bind(const FrameState &frame, const DrawState &draw)
 	{
 		Use(); // make this program run
-		setUniform(state.MVP, "MVP");
-		setUniform(state.M, "M");
-		setUniform(state.Minv, "Minv");
-		setUniform(state.wEye, "wEye");
-		setUniform(*state.texture, std::string("diffuseTexture"));
-		setUniformMaterial(*state.material, "material");
-
-		setUniform((int)state.lights.size(), "nLights");
-		for (unsigned int i = 0; i < state.lights.size(); i++)
-		{
-			setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
-		}
+		setUniform(draw.MVP, "MVP");
+		setUniform(draw.M, "M");
+		setUniform(draw.Minv, "Minv");
+		setUniform(frame.wEye, "wEye");
+		setUniformVertexFormat(draw);
+		setUniform(*draw.texture, "diffuseTexture");
+		setUniformMaterial(*draw.material);
+		setUniformLights(*frame.lightGrid);
 	}
 };
 
@@ -497,9 +1527,6 @@ class NPRShader : public Shader
 {
 	//---------------------------
 	const char *vertexSource = R"(
-		#version 330
-		precision highp float;
-
 		uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
 		uniform	vec4  wLightPos;
 		uniform vec3  wEye;         // pos of eye
@@ -512,20 +1539,27 @@ class NPRShader : public Shader
 		out vec2 texcoord;
 
 		void main() {
-		   gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
-		   vec4 wPos = vec4(vtxPos, 1) * M;
+		   vec3 pos, norm;
+		   vec2 uv = vtxUV;
+		   if (surfaceType != 0) {
+		      uv = surfaceUV();
+		      surfaceEval(uv, pos, norm);
+		   } else {
+		      pos = vtxPos * posScale + posBias;
+		      norm = (octNormals != 0) ? octDecode(vtxNorm.xy) : vtxNorm;
+		   }
+		   mirrorInstance(gl_InstanceID, pos, norm);
+		   gl_Position = vec4(pos, 1) * MVP; // to NDC
+		   vec4 wPos = vec4(pos, 1) * M;
 		   wLight = wLightPos.xyz * wPos.w - wPos.xyz * wLightPos.w;
 		   wView  = wEye * wPos.w - wPos.xyz;
-		   wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
-		   texcoord = vtxUV;
+		   wNormal = (Minv * vec4(norm, 0)).xyz;
+		   texcoord = uv;
 		}
 	)";
 
 	// fragment shader in GLSL
 	const char *fragmentSource = R"(
-		#version 330
-		precision highp float;
-
 		uniform sampler2D diffuseTexture;
 
 		in  vec3 wNormal, wView, wLight;	// interpolated
@@ -542,370 +1576,4202 @@ class NPRShader : public Shader
 	)";
 
 public:
-	NPRShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+	NPRShader()
+	{
+		TRACE_SCOPE("compile NPRShader");
+		create(Source({surfaceSource, vertexSource}).c_str(), Source({fragmentSource}).c_str(), "fragmentColor");
+	}
 
-	void Bind(RenderState state)
+	void Bind(const FrameState &frame, const DrawState &draw)
 	{
 		Use(); // make this program run
-		setUniform(state.MVP, "MVP");
-		setUniform(state.M, "M");
-		setUniform(state.Minv, "Minv");
-		setUniform(state.wEye, "wEye");
-		setUniform(*state.texture, std::string("diffuseTexture"));
-		setUniform(state.lights[0].wLightPos, "wLightPos");
+		setUniform(draw.MVP, "MVP");
+		setUniform(draw.M, "M");
+		setUniform(draw.Minv, "Minv");
+		setUniform(frame.wEye, "wEye");
+		setUniformVertexFormat(draw);
+		setUniform(*draw.texture, "diffuseTexture");
+		setUniform(frame.lights[0].wLightPos, "wLightPos");
 	}
 };
 
 //---------------------------
-class Geometry
+struct RayHit
 {
 	//---------------------------
-protected:
-	unsigned int vao, vbo; // vertex array object
-public:
-	Geometry()
-	{
-		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
-		glGenBuffers(1, &vbo); // Generate 1 vertex buffer object
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	}
-	virtual void Draw() = 0;
-	~Geometry()
-	{
-		glDeleteBuffers(1, &vbo);
-		glDeleteVertexArrays(1, &vao);
-	}
+	float t;			   // ray parameter, the same in world and modeling space
+	vec3 position, normal; // in world space
+	vec2 uv;			   // surface parameters
+	vec3 mirror;		   // reflection of the instance that was hit, (1, 1, 1) without mirroring
+	struct Object *object;
 };
 
 //---------------------------
-class ParamSurface : public Geometry
-{
+class TriangleBVH
+{ // bounding volume hierarchy built with the binned surface area heuristic
 	//---------------------------
 public:
-	struct VertexData
+	struct Triangle
 	{
-		vec3 position, normal;
-		vec2 texcoord;
+		vec3 a, b, c;
+		vec2 ta, tb, tc; // surface parameters of the vertices
 	};
 
-	unsigned int nVtxPerStrip, nStrips;
+private:
+	struct Node
+	{
+		vec3 lo, hi;
+		unsigned int first, count; // triangles of a leaf, count = 0 for inner nodes
+		unsigned int left;		   // inner node: children are left and left + 1
+	};
 
-	ParamSurface() { nVtxPerStrip = nStrips = 0; }
+	static const int maxDepth = 48; // deeper nodes stay leaves, bounds the traversal stack
+	std::vector<Node> nodes;
+	std::vector<Triangle> triangles;
+	std::vector<vec3> centroids;
 
-	virtual void eval(Dnum2 &U, Dnum2 &V, Dnum2 &X, Dnum2 &Y, Dnum2 &Z) = 0;
+	static vec3 Min(vec3 a, vec3 b) { return vec3(fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z)); }
+	static vec3 Max(vec3 a, vec3 b) { return vec3(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z)); }
+	static float Area(vec3 lo, vec3 hi)
+	{
+		vec3 e = hi - lo;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+	static float Axis(const vec3 &v, int axis) { return axis == 0 ? v.x : (axis == 1 ? v.y : v.z); }
 
-	VertexData GenVertexData(float u, float v)
+	void Bounds(Node &node)
 	{
-		VertexData vtxData;
-		vtxData.texcoord = vec2(u, v);
-		Dnum2 X, Y, Z;
-		Dnum2 U(u, vec2(1, 0)), V(v, vec2(0, 1));
-		eval(U, V, X, Y, Z);
-		vtxData.position = vec3(X.f, Y.f, Z.f);
-		vec3 drdU(X.d.x, Y.d.x, Z.d.x), drdV(X.d.y, Y.d.y, Z.d.y);
-		vtxData.normal = cross(drdU, drdV);
-		return vtxData;
+		node.lo = vec3(INFINITY, INFINITY, INFINITY);
+		node.hi = -node.lo;
+		for (unsigned int i = node.first; i < node.first + node.count; i++)
+		{
+			node.lo = Min(node.lo, Min(triangles[i].a, Min(triangles[i].b, triangles[i].c)));
+			node.hi = Max(node.hi, Max(triangles[i].a, Max(triangles[i].b, triangles[i].c)));
+		}
 	}
 
-	void create(int N = tessellationLevel, int M = tessellationLevel)
+	void Subdivide(unsigned int n, int depth)
 	{
-		nVtxPerStrip = (M + 1) * 2;
-		nStrips = N;
-		std::vector<VertexData> vtxData; // vertices on the CPU
-		for (int i = 0; i < N; i++)
+		const int nBins = 16;
+		Node node = nodes[n];
+		if (node.count <= 2 || depth >= maxDepth)
+			return;
+		vec3 cLo = centroids[node.first], cHi = cLo;
+		for (unsigned int i = node.first; i < node.first + node.count; i++)
 		{
-			for (int j = 0; j <= M; j++)
+			cLo = Min(cLo, centroids[i]);
+			cHi = Max(cHi, centroids[i]);
+		}
+		float bestCost = node.count * Area(node.lo, node.hi); // cost of keeping the leaf
+		int bestAxis = -1, bestSplit = 0;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float lo = Axis(cLo, axis), extent = Axis(cHi, axis) - lo;
+			if (extent <= 0)
+				continue;
+			vec3 binLo[nBins], binHi[nBins];
+			unsigned int binCount[nBins] = {0};
+			for (int b = 0; b < nBins; b++)
+			{
+				binLo[b] = vec3(INFINITY, INFINITY, INFINITY);
+				binHi[b] = -binLo[b];
+			}
+			for (unsigned int i = node.first; i < node.first + node.count; i++)
+			{
+				int b = std::min(nBins - 1, (int)((Axis(centroids[i], axis) - lo) / extent * nBins));
+				binCount[b]++;
+				binLo[b] = Min(binLo[b], Min(triangles[i].a, Min(triangles[i].b, triangles[i].c)));
+				binHi[b] = Max(binHi[b], Max(triangles[i].a, Max(triangles[i].b, triangles[i].c)));
+			}
+			// sweep from the right to get the cost of the right sides, then from the left
+			float rightArea[nBins];
+			unsigned int rightCount[nBins];
+			vec3 lo3 = binLo[nBins - 1], hi3 = binHi[nBins - 1];
+			unsigned int count = 0;
+			for (int b = nBins - 1; b > 0; b--)
+			{
+				lo3 = Min(lo3, binLo[b]);
+				hi3 = Max(hi3, binHi[b]);
+				count += binCount[b];
+				rightArea[b] = count ? Area(lo3, hi3) : 0;
+				rightCount[b] = count;
+			}
+			lo3 = binLo[0];
+			hi3 = binHi[0];
+			count = 0;
+			for (int b = 0; b < nBins - 1; b++)
 			{
-				vtxData.push_back(GenVertexData((float)j / M, (float)i / N));
-				vtxData.push_back(GenVertexData((float)j / M, (float)(i + 1) / N));
+				lo3 = Min(lo3, binLo[b]);
+				hi3 = Max(hi3, binHi[b]);
+				count += binCount[b];
+				float cost = (count ? count * Area(lo3, hi3) : 0) + rightCount[b + 1] * rightArea[b + 1];
+				if (count > 0 && rightCount[b + 1] > 0 && cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b + 1;
+				}
 			}
 		}
-		glBufferData(GL_ARRAY_BUFFER, nVtxPerStrip * nStrips * sizeof(VertexData), &vtxData[0], GL_STATIC_DRAW);
-		// Enable the vertex attribute arrays
-		glEnableVertexAttribArray(0); // attribute array 0 = POSITION
-		glEnableVertexAttribArray(1); // attribute array 1 = NORMAL
-		glEnableVertexAttribArray(2); // attribute array 2 = TEXCOORD0
-		// attribute array, components/attribute, component type, normalize?, stride, offset
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void *)offsetof(VertexData, position));
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void *)offsetof(VertexData, normal));
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void *)offsetof(VertexData, texcoord));
+		if (bestAxis < 0)
+			return;
+
+		float lo = Axis(cLo, bestAxis), extent = Axis(cHi, bestAxis) - lo;
+		unsigned int i = node.first, j = node.first + node.count;
+		while (i < j) // partition the triangles by the bin of their centroid
+		{
+			int b = std::min(nBins - 1, (int)((Axis(centroids[i], bestAxis) - lo) / extent * nBins));
+			if (b < bestSplit)
+				i++;
+			else
+			{
+				j--;
+				std::swap(triangles[i], triangles[j]);
+				std::swap(centroids[i], centroids[j]);
+			}
+		}
+		Node left = {vec3(), vec3(), node.first, i - node.first, 0};
+		Node right = {vec3(), vec3(), i, node.first + node.count - i, 0};
+		Bounds(left);
+		Bounds(right);
+		unsigned int l = nodes.size();
+		nodes.push_back(left);
+		nodes.push_back(right);
+		nodes[n].count = 0;
+		nodes[n].left = l;
+		Subdivide(l, depth + 1);
+		Subdivide(l + 1, depth + 1);
 	}
 
-	void Draw()
+	static bool HitBox(const Node &node, vec3 o, vec3 invD, float tMax)
 	{
-		glBindVertexArray(vao);
-		for (unsigned int i = 0; i < nStrips; i++)
-			glDrawArrays(GL_TRIANGLE_STRIP, i * nVtxPerStrip, nVtxPerStrip);
+		float t0 = 0, t1 = tMax;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float ta = (Axis(node.lo, axis) - Axis(o, axis)) * Axis(invD, axis);
+			float tb = (Axis(node.hi, axis) - Axis(o, axis)) * Axis(invD, axis);
+			t0 = fmaxf(t0, fminf(ta, tb));
+			t1 = fminf(t1, fmaxf(ta, tb));
+		}
+		return t0 <= t1;
+	}
+
+public:
+	bool Empty() { return nodes.empty(); }
+
+	void Build(const std::vector<Triangle> &_triangles)
+	{
+		triangles = _triangles;
+		centroids.resize(triangles.size());
+		for (unsigned int i = 0; i < triangles.size(); i++)
+			centroids[i] = (triangles[i].a + triangles[i].b + triangles[i].c) / 3;
+		nodes.clear();
+		Node root = {vec3(), vec3(), 0, (unsigned int)triangles.size(), 0};
+		Bounds(root);
+		nodes.push_back(root);
+		Subdivide(0, 0);
+	}
+
+	// nearest hit closer than t, Moller-Trumbore test in the leaves
+	bool Intersect(vec3 o, vec3 d, float &t, vec2 &uv)
+	{
+		if (nodes.empty())
+			return false;
+		vec3 invD(1 / d.x, 1 / d.y, 1 / d.z);
+		bool found = false;
+		unsigned int stack[maxDepth + 1], top = 0; // a pending sibling per level and the two children of the deepest
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const Node &node = nodes[stack[--top]];
+			if (!HitBox(node, o, invD, t))
+				continue;
+			if (node.count == 0)
+			{
+				stack[top++] = node.left;
+				stack[top++] = node.left + 1;
+				continue;
+			}
+			for (unsigned int i = node.first; i < node.first + node.count; i++)
+			{
+				const Triangle &tri = triangles[i];
+				vec3 e1 = tri.b - tri.a, e2 = tri.c - tri.a;
+				vec3 p = cross(d, e2);
+				float det = dot(e1, p);
+				if (fabsf(det) < 1e-12f)
+					continue;
+				vec3 s = o - tri.a;
+				float b1 = dot(s, p) / det;
+				vec3 q = cross(s, e1);
+				float b2 = dot(d, q) / det;
+				float tHit = dot(e2, q) / det;
+				if (b1 < 0 || b2 < 0 || b1 + b2 > 1 || tHit <= 0 || tHit >= t)
+					continue;
+				t = tHit;
+				uv = tri.ta * (1 - b1 - b2) + tri.tb * b1 + tri.tc * b2;
+				found = true;
+			}
+		}
+		return found;
 	}
 };
 
-//--------------------------- Samer
-class Bowl : public ParamSurface
+// Vertex compression helpers
+inline unsigned short QuantizeUnorm(float f)
 {
-	float x, y;
+	return (unsigned short)(fminf(fmaxf(f, 0), 1) * 65535.0f + 0.5f);
+}
+
+inline short QuantizeSnorm(float f)
+{
+	return (short)roundf(fminf(fmaxf(f, -1), 1) * 32767.0f);
+}
+
+vec2 OctEncode(vec3 n)
+{ // projects the direction onto the octahedron and unfolds the lower half
+	float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if (l1 == 0)
+		return vec2(0, 0); // degenerate normal, e.g. at the poles of the sphere
+	n = n / l1;
+	if (n.z >= 0)
+		return vec2(n.x, n.y);
+	return vec2((1 - fabsf(n.y)) * (n.x >= 0 ? 1 : -1), (1 - fabsf(n.x)) * (n.y >= 0 ? 1 : -1));
+}
+
+//---------------------------
+class ImpostorShader : public Shader
+{ // instanced quads facing the eye, the fragment shader intersects the exact sphere
+	//---------------------------
+	const char *vertexSource = R"(
+		uniform mat4  VP;           // view-projection
+		uniform vec3  wEye;         // pos of eye
+
+		layout(location = 0) in vec4  centerRadius;   // per instance: sphere in world space
+		layout(location = 1) in vec4  kdShininess;    // per instance: material
+		layout(location = 2) in vec3  ks;
+		layout(location = 3) in vec3  ka;
+
+		out vec3 wPos;              // point of the quad in world space
+		flat out vec4 sphere;
+		flat out vec4 matKd;
+		flat out vec3 matKs, matKa;
+
+		void main() {
+			vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2 - 1;
+			vec3 w = centerRadius.xyz - wEye;
+			float d = length(w), r = centerRadius.w;
+			w = w / d;
+			vec3 u = normalize(cross(abs(w.y) < 0.99 ? vec3(0, 1, 0) : vec3(1, 0, 0), w));
+			vec3 v = cross(w, u);
+			float s = r * d / sqrt(max(d * d - r * r, 1e-6)); // radius of the tangent cone at the center
+			wPos = centerRadius.xyz + (corner.x * u + corner.y * v) * s;
+			gl_Position = vec4(wPos, 1) * VP;
+			sphere = centerRadius;
+			matKd = kdShininess;
+			matKs = ks;
+			matKa = ka;
+		}
+	)";
+
+	// fragment shader in GLSL
+	const char *fragmentSource = R"(
+		uniform mat4  VP;
+		uniform vec3  wEye;
+
+		in vec3 wPos;
+		flat in vec4 sphere;
+		flat in vec4 matKd;
+		flat in vec3 matKs, matKa;
+
+		out vec4 fragmentColor;     // output goes to frame buffer
+
+		void main() {
+			vec3 dir = normalize(wPos - wEye);
+			vec3 oc = wEye - sphere.xyz;
+			float b = dot(dir, oc), disc = b * b - dot(oc, oc) + sphere.w * sphere.w;
+			if (disc < 0) discard;
+			vec3 hit = wEye + dir * (-b - sqrt(disc));
+			vec4 ndc = vec4(hit, 1) * VP;
+			gl_FragDepth = ndc.z / ndc.w * 0.5 + 0.5;
+
+			vec3 N = (hit - sphere.xyz) / sphere.w;
+			vec3 V = -dir;
+			vec3 radiance = tileRadiance(ivec2(gl_FragCoord.xy) / tileSize, vec4(hit, 1), N, V, matKa, matKd.rgb, matKs, matKd.w);
+			fragmentColor = vec4(radiance, 1);
+		}
+	)";
 
 public:
-	Bowl(float _x, float _y)
+	ImpostorShader()
 	{
-
-		this->x = _x;
-		this->y = _y;
-		create();
+		TRACE_SCOPE("compile ImpostorShader");
+		create(Source({vertexSource}).c_str(), Source({lightSource, fragmentSource}).c_str(), "fragmentColor");
 	}
-	void eval(Dnum2 &U, Dnum2 &V, Dnum2 &X, Dnum2 &Y, Dnum2 &Z)
+
+	// the spheres come from the instances, nothing is per draw
+	void Bind(const FrameState &frame)
 	{
-		//U = U * 2.0f * (float)M_PI, V = V * (float)M_PI;
-		X = U * this->x;
-		Y = V * this->y;
-		Z = Cosh(Pow(X, 2) + Pow(Y, 2));
+		Use(); // make this program run
+		setUniform(frame.VP, "VP");
+		setUniform(frame.wEye, "wEye");
+		setUniformLights(*frame.lightGrid);
 	}
+	void Bind(const FrameState &frame, const DrawState &draw) { Bind(frame); }
 };
 
 //---------------------------
-class Sphere : public ParamSurface
-{
+class BallPhysicsProgram : public GPUProgram
+{ // one substep of Ball::Animate per vertex, the results are captured by transform feedback
 	//---------------------------
+	const char *vertexSource = R"(
+		#version 330
+		precision highp float;
+
+		uniform float tend;
+
+		layout(location = 0) in vec4  position;   // w: radius
+		layout(location = 1) in vec4  direction;
+		layout(location = 2) in vec4  velocity;
+		layout(location = 3) in vec4  normal;
+
+		out vec4 outPosition, outDirection, outVelocity, outNormal;
+
+		void main() {
+			vec3 gravity = vec3(0, 0, -3);
+			vec3 n = normal.xyz;
+			vec3 acceleration = gravity - dot(gravity, n) * n;
+			vec3 v = velocity.xyz + acceleration * 0.001 * tend;
+			vec3 d = direction.xyz + v * 0.001 * tend;
+			// snap to the bowl quadrant of the ball, its normal flips with the mirroring
+			vec2 s = mix(vec2(1.0), vec2(-1.0), lessThan(d.xy, vec2(0.0))); // 0 counts as positive like in Ball::Animate
+			float r2 = dot(d.xy, d.xy);
+			n = normalize(s.x * s.y * vec3(-2 * d.x * sinh(r2), -2 * d.y * sinh(r2), 1));
+			vec3 p = 2 * vec3(d.xy, cosh(r2)) + 0.1 * n;
+
+			outPosition = vec4(p, position.w);
+			outDirection = vec4(d, 0);
+			outVelocity = vec4(v, 0);
+			outNormal = vec4(n, 0);
+		}
+	)";
+
+	// no fragments are generated, the rasterizer is discarded
+	const char *fragmentSource = R"(
+		#version 330
+		out vec4 fragmentColor;
+		void main() { fragmentColor = vec4(0); }
+	)";
+
 public:
-	Sphere() { create(); }
-	void eval(Dnum2 &U, Dnum2 &V, Dnum2 &X, Dnum2 &Y, Dnum2 &Z)
+	BallPhysicsProgram()
 	{
-		U = U * 2.0f * (float)M_PI, V = V * (float)M_PI;
-		X = Cos(U) * Sin(V);
-		Y = Sin(U) * Sin(V);
-		Z = Cos(V);
+		setFeedbackVaryings({"outPosition", "outDirection", "outVelocity", "outNormal"});
+		create(vertexSource, fragmentSource, "fragmentColor");
 	}
 };
 
 //---------------------------
-struct Object
-{
+class Arena
+{ // bump allocation in large blocks, everything is destroyed together in reverse order of creation
 	//---------------------------
-	Shader *shader;
-	Material *material;
-	Texture *texture;
-	Geometry *geometry;
-	vec3 scale, translation, rotationAxis;
-	float rotationAngle;
+	static constexpr size_t blockSize = 64 * 1024; // constexpr: inline, std::max takes it by reference
+	std::vector<char *> blocks;
+	size_t used = blockSize; // in the last block
+	std::vector<std::pair<void *, void (*)(void *)>> destructors;
 
-public:
-	Object(Shader *_shader, Material *_material, Texture *_texture, Geometry *_geometry) : scale(vec3(1, 1, 1)), translation(vec3(0, 0, 0)), rotationAxis(0, 0, 1), rotationAngle(0)
+	void *Allocate(size_t size, size_t alignment)
 	{
-		shader = _shader;
-		texture = _texture;
-		material = _material;
-		geometry = _geometry;
+		used = (used + alignment - 1) & ~(alignment - 1);
+		if (used + size > blockSize)
+		{ // objects larger than a block get a block of their own
+			blocks.push_back((char *)operator new(std::max(size, blockSize)));
+			used = 0;
+		}
+		void *p = blocks.back() + used;
+		used += size;
+		return p;
 	}
 
-	virtual void SetModelingTransform(mat4 &M, mat4 &Minv)
+public:
+	// the pointers stay valid until Clear, objects of one type created together are adjacent in memory
+	template <class T, class... Args>
+	T *New(Args &&...args)
 	{
-		M = ScaleMatrix(scale) * RotationMatrix(rotationAngle, rotationAxis) * TranslateMatrix(translation);
-		Minv = TranslateMatrix(-translation) * RotationMatrix(-rotationAngle, rotationAxis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
+		T *object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		destructors.push_back(std::make_pair((void *)object, [](void *p)
+											 { ((T *)p)->~T(); }));
+		return object;
 	}
 
-	void Draw(RenderState state)
+	// n adjacent objects constructed from the same arguments, one destructor entry for all of them
+	template <class T, class... Args>
+	T *NewArray(size_t n, const Args &...args)
 	{
-		mat4 M, Minv;
-		SetModelingTransform(M, Minv);
-		state.M = M;
-		state.Minv = Minv;
-		state.MVP = state.M * state.V * state.P;
-		state.material = material;
-		state.texture = texture;
-		shader->Bind(state);
-		geometry->Draw();
+		const size_t header = (sizeof(size_t) + alignof(T) - 1) / alignof(T) * alignof(T); // the count precedes the objects
+		char *base = (char *)Allocate(header + n * sizeof(T), std::max(alignof(T), alignof(size_t)));
+		*(size_t *)base = n;
+		T *array = (T *)(base + header);
+		for (size_t i = 0; i < n; i++)
+			new (array + i) T(args...);
+		destructors.push_back(std::make_pair((void *)base, [](void *p)
+											 {
+												 size_t header = (sizeof(size_t) + alignof(T) - 1) / alignof(T) * alignof(T);
+												 T *array = (T *)((char *)p + header);
+												 for (size_t i = *(size_t *)p; i-- > 0;)
+													 array[i].~T(); }));
+		return array;
 	}
 
-	virtual void Animate(float tstart, float tend)
+	void Clear()
 	{
-		//rotationAngle = 0.8f * tend;
+		for (auto d = destructors.rbegin(); d != destructors.rend(); ++d)
+			d->second(d->first);
+		destructors.clear();
+		for (char *block : blocks)
+			operator delete(block);
+		blocks.clear();
+		used = blockSize;
 	}
+
+	~Arena() { Clear(); }
 };
 
-class Ball : public Object
+//---------------------------
+class Geometry
 {
+	//---------------------------
 public:
-	vec3 direction, normal, velocity, acceleration, gravity;
-	Ball(vec3 _velocity,
-		 vec3 _normal,
-		 vec3 _direction,
+	vec3 posScale, posBias;	 // dequantization of compact vertex positions
+	bool octNormals;		 // normals are octahedral encoded
+	unsigned int vertexSize; // bytes per vertex in the vertex buffer
+	vec3 center;			 // bounding sphere in modeling space
+	float radius;
+	vec3 boxLo, boxHi;		 // bounding box in modeling space
+	int surfaceType;		 // procedural surface evaluated in the vertex shader, 0: vertex buffer
+
+	Geometry() : posScale(1, 1, 1), posBias(0, 0, 0), octNormals(false), vertexSize(0), radius(0), surfaceType(0) {}
+	virtual void Draw() = 0;
+	virtual void Draw(int lod, int instances = 1) { Draw(); }
+	virtual int LodCount() { return 1; }
+	virtual unsigned int TriangleCount(int lod) { return 0; }
+	virtual vec2 SurfaceTessellation(int lod) { return vec2(0, 0); }
+	virtual bool IsSphere() { return false; } // unit sphere that impostors can replace
+	// nearest intersection with the ray in modeling space, fills t, uv and the modeling space position and normal
+	virtual bool Intersect(vec3 origin, vec3 dir, RayHit &hit) { return false; }
+	virtual ~Geometry() {}
+};
+
+//---------------------------
+class GeometryPool
+{ // the meshes of all vertex buffer geometries in one vertex and one index buffer behind one vao, drawn with base vertex offsets
+	//---------------------------
+public:
+	struct Attribute
+	{
+		int components;
+		GLenum type;
+		bool normalized;
+		unsigned int offset;
+	};
+
+	struct Allocation
+	{ // the indices are relative to firstVertex
+		unsigned int firstVertex, nVertices, firstIndex, nIndices;
+		bool live;
+	};
+
+private:
+	struct Range
+	{
+		unsigned int first, count;
+	};
+
+	static constexpr unsigned int minVertices = 64 * 1024, minIndices = 128 * 1024; // constexpr: inline, std::max takes them by reference
+	static const unsigned int maxFragments = 16; // free ranges of a buffer that trigger a compaction
+	std::vector<Allocation> allocations;
+	std::vector<int> freeHandles;
+	std::vector<Range> freeVertices, freeIndices; // sorted, adjacent ranges are merged
+	std::vector<Attribute> format;
+	unsigned int vao = 0, vbo = 0, ibo = 0;
+	unsigned int vertexCapacity = 0, indexCapacity = 0;
+
+	// first fit
+	static bool Take(std::vector<Range> &ranges, unsigned int count, unsigned int &first)
+	{
+		for (unsigned int i = 0; i < ranges.size(); i++)
+			if (ranges[i].count >= count)
+			{
+				first = ranges[i].first;
+				ranges[i].first += count;
+				ranges[i].count -= count;
+				if (ranges[i].count == 0)
+					ranges.erase(ranges.begin() + i);
+				return true;
+			}
+		return false;
+	}
+
+	static void Give(std::vector<Range> &ranges, unsigned int first, unsigned int count)
+	{
+		if (count == 0)
+			return;
+		auto range = std::lower_bound(ranges.begin(), ranges.end(), first, [](const Range &r, unsigned int f)
+									  { return r.first < f; });
+		range = ranges.insert(range, Range{first, count});
+		if (range + 1 != ranges.end() && range->first + range->count == (range + 1)->first)
+		{
+			range->count += (range + 1)->count;
+			ranges.erase(range + 1);
+		}
+		if (range != ranges.begin() && (range - 1)->first + (range - 1)->count == range->first)
+		{
+			(range - 1)->count += range->count;
+			ranges.erase(range);
+		}
+	}
+
+	static bool Fits(const std::vector<Range> &ranges, unsigned int count)
+	{
+		for (const Range &range : ranges)
+			if (range.count >= count)
+				return true;
+		return false;
+	}
+
+	static unsigned int FreeCount(const std::vector<Range> &ranges)
+	{
+		unsigned int n = 0;
+		for (const Range &range : ranges)
+			n += range.count;
+		return n;
+	}
+
+	// copies the live meshes packed to the start of new buffers, the free space becomes one range at the end of each
+	void Repack(unsigned int _vertexCapacity, unsigned int _indexCapacity)
+	{
+		TRACE_SCOPE("GeometryPool::Repack");
+		std::vector<int> live;
+		for (unsigned int h = 0; h < allocations.size(); h++)
+			if (allocations[h].live)
+				live.push_back(h);
+		unsigned int buffers[2] = {0, 0};
+		if (!headless) // without GL only the offsets and the free lists are updated, for the checks of bench
+			glGenBuffers(2, buffers);
+		for (int b = 0; b < 2; b++)
+		{ // vertices, then indices, moved in the order of their position so the packing keeps it
+			bool vertices = b == 0;
+			size_t elementSize = vertices ? vertexSize : sizeof(unsigned int);
+			unsigned int capacity = vertices ? _vertexCapacity : _indexCapacity;
+			std::sort(live.begin(), live.end(), [this, vertices](int i, int j)
+					  { return vertices ? allocations[i].firstVertex < allocations[j].firstVertex : allocations[i].firstIndex < allocations[j].firstIndex; });
+			if (!headless)
+			{
+				glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[b]);
+				glBufferData(GL_COPY_WRITE_BUFFER, capacity * elementSize, NULL, GL_STATIC_DRAW);
+				glBindBuffer(GL_COPY_READ_BUFFER, vertices ? vbo : ibo);
+			}
+			unsigned int cursor = 0;
+			for (int h : live)
+			{
+				Allocation &a = allocations[h];
+				unsigned int &first = vertices ? a.firstVertex : a.firstIndex, count = vertices ? a.nVertices : a.nIndices;
+				if (count > 0 && !headless)
+					glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, first * elementSize, cursor * elementSize, count * elementSize);
+				first = cursor;
+				cursor += count;
+			}
+			std::vector<Range> &ranges = vertices ? freeVertices : freeIndices;
+			ranges.clear();
+			Give(ranges, cursor, capacity - cursor);
+		}
+		vertexCapacity = _vertexCapacity;
+		indexCapacity = _indexCapacity;
+		repacks++;
+		if (headless)
+			return;
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		if (vbo)
+		{
+			glDeleteBuffers(1, &vbo);
+			glDeleteBuffers(1, &ibo);
+		}
+		vbo = buffers[0];
+		ibo = buffers[1];
+		glBindVertexArray(vao); // the attributes point into the new buffers
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		for (unsigned int i = 0; i < format.size(); i++)
+		{
+			const Attribute &attribute = format[i];
+			glEnableVertexAttribArray(i);
+			glVertexAttribPointer(i, attribute.components, attribute.type, attribute.normalized, vertexSize, (void *)(size_t)attribute.offset);
+		}
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo); // part of the vao state
+	}
+
+public:
+	unsigned int vertexSize = 0; // bytes, one vertex format per pool, the other formats have their own
+	int repacks = 0;			 // compactions and growths
+
+	// the first allocation sets the vertex format, attribute i is fed by format[i]
+	int Allocate(const void *vertices, unsigned int nVertices, unsigned int _vertexSize, const std::vector<Attribute> &_format,
+				 const std::vector<unsigned int> &indices)
+	{
+		if (format.empty())
+		{
+			vertexSize = _vertexSize;
+			format = _format;
+		}
+		else if (_vertexSize != vertexSize)
+		{
+			printf("Geometry pool holds %u byte vertices, a mesh of %u byte vertices cannot be added\n", vertexSize, _vertexSize);
+			return -1;
+		}
+		if (!vao && !headless)
+			glGenVertexArrays(1, &vao);
+		unsigned int nIndices = indices.size();
+		if (!Fits(freeVertices, nVertices) || !Fits(freeIndices, nIndices))
+		{ // compaction when the pool stays at most 3/4 full, otherwise it doubles
+			unsigned int usedVertices = vertexCapacity - FreeCount(freeVertices) + nVertices, usedIndices = indexCapacity - FreeCount(freeIndices) + nIndices;
+			unsigned int newVertexCapacity = std::max(vertexCapacity, minVertices), newIndexCapacity = std::max(indexCapacity, minIndices);
+			while (usedVertices > newVertexCapacity / 4 * 3)
+				newVertexCapacity *= 2;
+			while (usedIndices > newIndexCapacity / 4 * 3)
+				newIndexCapacity *= 2;
+			Repack(newVertexCapacity, newIndexCapacity);
+		}
+		int handle;
+		if (freeHandles.empty())
+		{
+			handle = allocations.size();
+			allocations.push_back(Allocation());
+		}
+		else
+		{
+			handle = freeHandles.back();
+			freeHandles.pop_back();
+		}
+		Allocation &a = allocations[handle];
+		Take(freeVertices, nVertices, a.firstVertex);
+		Take(freeIndices, nIndices, a.firstIndex);
+		a.nVertices = nVertices;
+		a.nIndices = nIndices;
+		a.live = true;
+		if (headless)
+			return handle;
+		glBindBuffer(GL_COPY_WRITE_BUFFER, vbo); // not the vao state
+		glBufferSubData(GL_COPY_WRITE_BUFFER, (size_t)a.firstVertex * vertexSize, (size_t)nVertices * vertexSize, vertices);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, ibo);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, (size_t)a.firstIndex * sizeof(unsigned int), nIndices * sizeof(unsigned int), &indices[0]);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		return handle;
+	}
+
+	// the ranges go back to the free lists, many holes are closed by moving the meshes together
+	void Free(int handle)
+	{
+		if (handle < 0 || handle >= (int)allocations.size() || !allocations[handle].live)
+			return; // also the handles of a released pool
+		Allocation &a = allocations[handle];
+		a.live = false;
+		Give(freeVertices, a.firstVertex, a.nVertices);
+		Give(freeIndices, a.firstIndex, a.nIndices);
+		freeHandles.push_back(handle);
+		if (freeHandles.size() == allocations.size())
+			return; // empty, nothing to move
+		if (freeVertices.size() > maxFragments || freeIndices.size() > maxFragments)
+			Compact();
+	}
+
+	void Compact() { Repack(vertexCapacity, indexCapacity); }
+
+	// the offsets change with compactions, they are looked up at every draw
+	const Allocation &Get(int handle) const { return allocations[handle]; }
+
+	void Bind() { glBindVertexArray(vao); }
+
+	unsigned int UsedVertices() const { return vertexCapacity - FreeCount(freeVertices); }
+	unsigned int VertexCapacity() const { return vertexCapacity; }
+	int FreeRanges() const { return freeVertices.size() + freeIndices.size(); }
+
+	void Release()
+	{
+		if (!vao && allocations.empty())
+			return;
+		if (vbo)
+		{
+			glDeleteBuffers(1, &vbo);
+			glDeleteBuffers(1, &ibo);
+		}
+		if (vao)
+			glDeleteVertexArrays(1, &vao);
+		vao = vbo = ibo = 0;
+		vertexCapacity = indexCapacity = 0;
+		allocations.clear();
+		freeHandles.clear();
+		freeVertices.clear();
+		freeIndices.clear();
+		format.clear();
+		vertexSize = 0;
+	}
+};
+
+GeometryPool geometryPools[2]; // by vertex format: VertexData, PackedVertexData
+
+//---------------------------
+class ParamSurface : public Geometry
+{
+	//---------------------------
+public:
+	struct VertexData
+	{
+		vec3 position, normal;
+		vec2 texcoord;
+	};
+
+	struct PackedVertexData // 16 bytes instead of 32
+	{
+		unsigned short position[3]; // unorm16 in the bounding box of the mesh
+		unsigned short pad;			// keeps the normal 4-byte aligned
+		short normal[2];			// octahedral encoding, snorm16
+		unsigned short texcoord[2]; // unorm16
+	};
+
+	struct Lod
+	{ // strips of one level of detail, offsets within the mesh in the geometry pool
+		unsigned int first, nVtxPerStrip, nStrips;
+		unsigned int firstIndex, nIndices; // the strips joined by restart indices, drawn with one call
+	};
+
+	static const unsigned int restartIndex = 0xffffffff;
+
+	unsigned int nVtxPerStrip, nStrips; // of the finest level
+	std::vector<float> uKnots, vKnots;	// parameters of the grid lines of the finest level
+	std::vector<Lod> lods;				// finest first, each halves the grid lines of the previous one
+	TriangleBVH bvh;					// of the finest level, built at the first ray query
+
+	GeometryPool *pool = nullptr; // of the vertex format
+	int allocation = -1;		  // of the vertices and indices in the pool
+
+	ParamSurface() { nVtxPerStrip = nStrips = 0; }
+	~ParamSurface()
+	{
+		if (pool)
+			pool->Free(allocation);
+	}
+
+	virtual void eval(Dnum2 &U, Dnum2 &V, Dnum2 &X, Dnum2 &Y, Dnum2 &Z) = 0;
+
+	VertexData GenVertexData(float u, float v)
+	{
+		VertexData vtxData;
+		vtxData.texcoord = vec2(u, v);
+		Dnum2 X, Y, Z;
+		Dnum2 U(u, vec2(1, 0)), V(v, vec2(0, 1));
+		eval(U, V, X, Y, Z);
+		vtxData.position = vec3(X.f, Y.f, Z.f);
+		vec3 drdU(X.d.x, Y.d.x, Z.d.x), drdV(X.d.y, Y.d.y, Z.d.y);
+		vtxData.normal = cross(drdU, drdV);
+		return vtxData;
+	}
+
+	void create(int N = tessellationLevel, int M = tessellationLevel)
+	{
+		create(UniformKnots(M), UniformKnots(N));
+	}
+
+	// tensor product grid of the given u and v parameters, crack-free for any knot spacing
+	void create(const std::vector<float> &us, const std::vector<float> &vs)
+	{
+		TRACE_SCOPE("ParamSurface::create");
+		std::vector<VertexData> vtxData = Tessellate(us, vs);
+		if (headless)
+			return;
+		if (compactVertexFormat)
+			upload(Compress(vtxData), Indices());
+		else
+			upload(vtxData, Indices());
+	}
+
+	// CPU part of create: vertices of all levels of detail, the level table and the bounds
+	std::vector<VertexData> Tessellate(const std::vector<float> &us, const std::vector<float> &vs)
+	{
+		uKnots = us;
+		vKnots = vs;
+		nVtxPerStrip = us.size() * 2;
+		nStrips = vs.size() - 1;
+		std::vector<VertexData> vtxData; // vertices on the CPU, all levels of detail after each other
+		std::vector<float> lu = us, lv = vs;
+		lods.clear();
+		for (;;)
+		{
+			Lod lod = {(unsigned int)vtxData.size(), (unsigned int)lu.size() * 2, (unsigned int)lv.size() - 1, 0, 0};
+			for (unsigned int i = 0; i < lod.nStrips; i++)
+			{
+				for (unsigned int j = 0; j < lu.size(); j++)
+				{
+					vtxData.push_back(GenVertexData(lu[j], lv[i]));
+					vtxData.push_back(GenVertexData(lu[j], lv[i + 1]));
+				}
+			}
+			lods.push_back(lod);
+			if ((int)lods.size() == maxLods || lu.size() < 9 || lv.size() < 9)
+				break; // the next level would have less than 4 segments
+			lu = Decimate(lu);
+			lv = Decimate(lv);
+		}
+		Bounds(vtxData);
+		return vtxData;
+	}
+
+	// keeps every second knot and the last one
+	static std::vector<float> Decimate(const std::vector<float> &knots)
+	{
+		std::vector<float> coarse;
+		for (unsigned int i = 0; i < knots.size(); i += 2)
+			coarse.push_back(knots[i]);
+		if (coarse.back() != knots.back())
+			coarse.push_back(knots.back());
+		return coarse;
+	}
+
+	void Bounds(const std::vector<VertexData> &vtxData)
+	{
+		vec3 lo = vtxData[0].position, hi = vtxData[0].position;
+		for (const VertexData &vtx : vtxData)
+		{
+			lo = vec3(fminf(lo.x, vtx.position.x), fminf(lo.y, vtx.position.y), fminf(lo.z, vtx.position.z));
+			hi = vec3(fmaxf(hi.x, vtx.position.x), fmaxf(hi.y, vtx.position.y), fmaxf(hi.z, vtx.position.z));
+		}
+		boxLo = lo;
+		boxHi = hi;
+		center = (lo + hi) / 2;
+		radius = 0;
+		for (const VertexData &vtx : vtxData)
+			radius = fmaxf(radius, length(vtx.position - center));
+	}
+
+	static std::vector<float> UniformKnots(int N)
+	{
+		std::vector<float> knots(N + 1);
+		for (int i = 0; i <= N; i++)
+			knots[i] = (float)i / N;
+		return knots;
+	}
+
+	vec3 FirstDerivative(float u, float v, bool alongU)
+	{
+		Dnum2 X, Y, Z;
+		Dnum2 U(u, vec2(1, 0)), V(v, vec2(0, 1));
+		eval(U, V, X, Y, Z);
+		return alongU ? vec3(X.d.x, Y.d.x, Z.d.x) : vec3(X.d.y, Y.d.y, Z.d.y);
+	}
+
+	// second derivative along u or v by differencing the dual number derivatives
+	vec3 SecondDerivative(float u, float v, bool alongU)
+	{
+		const float delta = 1e-3f;
+		float t = alongU ? u : v;
+		float t0 = fmaxf(t - delta, 0), t1 = fminf(t + delta, 1);
+		vec3 d0 = alongU ? FirstDerivative(t0, v, true) : FirstDerivative(u, t0, false);
+		vec3 d1 = alongU ? FirstDerivative(t1, v, true) : FirstDerivative(u, t1, false);
+		return (d1 - d0) / (t1 - t0);
+	}
+
+	// places the knots so that the chord error h^2/8 * |r''| of every segment stays below maxError
+	std::vector<float> AdaptiveKnots(float maxError, bool alongU)
+	{
+		const int nSamples = 128, nCross = 8;
+		std::vector<float> curvature(nSamples + 1, 0.0f); // max |r''| over the other parameter
+		for (int k = 0; k <= nSamples; k++)
+			for (int l = 0; l <= nCross; l++)
+			{
+				float t = (float)k / nSamples, s = (float)l / nCross;
+				vec3 d2 = alongU ? SecondDerivative(t, s, true) : SecondDerivative(s, t, false);
+				curvature[k] = fmaxf(curvature[k], length(d2));
+			}
+
+		std::vector<float> knots(1, 0.0f);
+		int start = 0;
+		while (start < nSamples)
+		{
+			int end = start + 1;
+			float kMax = fmaxf(curvature[start], curvature[end]);
+			while (end < nSamples)
+			{
+				float k = fmaxf(kMax, curvature[end + 1]);
+				float h = (float)(end + 1 - start) / nSamples;
+				if (k * h * h / 8 > maxError)
+					break;
+				kMax = k;
+				end++;
+			}
+			knots.push_back((float)end / nSamples);
+			start = end;
+		}
+		return knots;
+	}
+
+	// max distance between the surface and the triangle strips, sampled at edge and diagonal midpoints
+	float TessellationError(const std::vector<float> &us, const std::vector<float> &vs)
+	{
+		float maxError = 0;
+		for (unsigned int i = 0; i + 1 < vs.size(); i++)
+			for (unsigned int j = 0; j + 1 < us.size(); j++)
+			{
+				float u0 = us[j], u1 = us[j + 1], v0 = vs[i], v1 = vs[i + 1];
+				float um = (u0 + u1) / 2, vm = (v0 + v1) / 2;
+				vec3 p00 = GenVertexData(u0, v0).position, p10 = GenVertexData(u1, v0).position;
+				vec3 p01 = GenVertexData(u0, v1).position, p11 = GenVertexData(u1, v1).position;
+				maxError = fmaxf(maxError, length(GenVertexData(um, v0).position - (p00 + p10) / 2));
+				maxError = fmaxf(maxError, length(GenVertexData(u0, vm).position - (p00 + p01) / 2));
+				maxError = fmaxf(maxError, length(GenVertexData(um, vm).position - (p01 + p10) / 2)); // strip diagonal
+				maxError = fmaxf(maxError, length(GenVertexData(um, v1).position - (p01 + p11) / 2));
+				maxError = fmaxf(maxError, length(GenVertexData(u1, vm).position - (p10 + p11) / 2));
+			}
+		return maxError;
+	}
+
+	// prints the vertex count of this tessellation against the uniform grid that reaches the same error
+	void ReportTessellation(const char *name)
+	{
+		float error = TessellationError(uKnots, vKnots);
+		int N = tessellationLevel;
+		float uniformError = TessellationError(UniformKnots(N), UniformKnots(N));
+		N = (int)fmaxf(1, ceilf(N * sqrtf(uniformError / error))); // error is quadratic in the spacing
+		while (TessellationError(UniformKnots(N), UniformKnots(N)) > error)
+			N++;
+		while (N > 1 && TessellationError(UniformKnots(N - 1), UniformKnots(N - 1)) <= error)
+			N--;
+		printf("%s tessellation: %u vertices at max error %f, uniform %dx%d grid needs %d vertices\n",
+			   name, nVtxPerStrip * nStrips, error, N, N, (N + 1) * 2 * N);
+	}
+
+	void upload(const std::vector<VertexData> &vtxData, const std::vector<unsigned int> &indices)
+	{
+		vertexSize = sizeof(VertexData);
+		// components/attribute, component type, normalize?, offset of attribute arrays 0 = POSITION, 1 = NORMAL, 2 = TEXCOORD0
+		static const std::vector<GeometryPool::Attribute> format = {{3, GL_FLOAT, false, offsetof(VertexData, position)},
+																	 {3, GL_FLOAT, false, offsetof(VertexData, normal)},
+																	 {2, GL_FLOAT, false, offsetof(VertexData, texcoord)}};
+		pool = &geometryPools[0];
+		allocation = pool->Allocate(&vtxData[0], vtxData.size(), vertexSize, format, indices);
+	}
+
+	void upload(const std::vector<PackedVertexData> &vtxData, const std::vector<unsigned int> &indices)
+	{
+		vertexSize = sizeof(PackedVertexData);
+		// POSITION unorm16 in the bounding box, NORMAL octahedral snorm16, TEXCOORD0 unorm16
+		static const std::vector<GeometryPool::Attribute> format = {{3, GL_UNSIGNED_SHORT, true, offsetof(PackedVertexData, position)},
+																	 {2, GL_SHORT, true, offsetof(PackedVertexData, normal)},
+																	 {2, GL_UNSIGNED_SHORT, true, offsetof(PackedVertexData, texcoord)}};
+		pool = &geometryPools[1];
+		allocation = pool->Allocate(&vtxData[0], vtxData.size(), vertexSize, format, indices);
+	}
+
+	// the strips of each level of detail as one strip list separated by restart indices, relative to the first vertex of the mesh
+	std::vector<unsigned int> Indices()
+	{
+		std::vector<unsigned int> indices;
+		for (Lod &level : lods)
+		{
+			level.firstIndex = indices.size();
+			for (unsigned int i = 0; i < level.nStrips; i++)
+			{
+				if (i > 0)
+					indices.push_back(restartIndex);
+				for (unsigned int k = 0; k < level.nVtxPerStrip; k++)
+					indices.push_back(level.first + i * level.nVtxPerStrip + k);
+			}
+			level.nIndices = indices.size() - level.firstIndex;
+		}
+		return indices;
+	}
+
+	// quantizes the vertices into the bounding box of the mesh and sets the decoding parameters
+	std::vector<PackedVertexData> Compress(const std::vector<VertexData> &vtxData)
+	{
+		vec3 lo = vtxData[0].position, hi = vtxData[0].position;
+		for (const VertexData &vtx : vtxData)
+		{
+			lo = vec3(fminf(lo.x, vtx.position.x), fminf(lo.y, vtx.position.y), fminf(lo.z, vtx.position.z));
+			hi = vec3(fmaxf(hi.x, vtx.position.x), fmaxf(hi.y, vtx.position.y), fmaxf(hi.z, vtx.position.z));
+		}
+		posBias = lo;
+		posScale = hi - lo;
+		octNormals = true;
+
+		std::vector<PackedVertexData> packed(vtxData.size());
+		for (unsigned int i = 0; i < vtxData.size(); i++)
+		{
+			vec3 p = vtxData[i].position - lo;
+			packed[i].position[0] = QuantizeUnorm(posScale.x > 0 ? p.x / posScale.x : 0);
+			packed[i].position[1] = QuantizeUnorm(posScale.y > 0 ? p.y / posScale.y : 0);
+			packed[i].position[2] = QuantizeUnorm(posScale.z > 0 ? p.z / posScale.z : 0);
+			packed[i].pad = 0;
+			vec2 n = OctEncode(vtxData[i].normal);
+			packed[i].normal[0] = QuantizeSnorm(n.x);
+			packed[i].normal[1] = QuantizeSnorm(n.y);
+			packed[i].texcoord[0] = QuantizeUnorm(vtxData[i].texcoord.x);
+			packed[i].texcoord[1] = QuantizeUnorm(vtxData[i].texcoord.y);
+		}
+		return packed;
+	}
+
+	void Draw() { Draw(0); }
+
+	void Draw(int lod, int instances = 1)
+	{ // the restart index is compared before the base vertex is added
+		if (allocation < 0)
+			return; // refused by the pool, or never uploaded
+		const Lod &level = lods[lod];
+		const GeometryPool::Allocation &mesh = pool->Get(allocation);
+		pool->Bind();
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLE_STRIP, level.nIndices, GL_UNSIGNED_INT, (void *)((mesh.firstIndex + level.firstIndex) * sizeof(unsigned int)),
+										  instances, mesh.firstVertex);
+		frameStats.drawCalls++;
+	}
+
+	int LodCount() { return lods.size(); }
+
+	unsigned int TriangleCount(int lod) { return lods[lod].nStrips * (lods[lod].nVtxPerStrip - 2); }
+
+	void BuildBVH()
+	{
+		std::vector<TriangleBVH::Triangle> triangles;
+		for (unsigned int i = 0; i < nStrips; i++)
+		{
+			std::vector<VertexData> strip;
+			for (unsigned int j = 0; j < uKnots.size(); j++)
+			{
+				strip.push_back(GenVertexData(uKnots[j], vKnots[i]));
+				strip.push_back(GenVertexData(uKnots[j], vKnots[i + 1]));
+			}
+			for (unsigned int k = 0; k + 2 < strip.size(); k++)
+			{
+				TriangleBVH::Triangle tri = {strip[k].position, strip[k + 1].position, strip[k + 2].position,
+											 strip[k].texcoord, strip[k + 1].texcoord, strip[k + 2].texcoord};
+				triangles.push_back(tri);
+			}
+		}
+		bvh.Build(triangles);
+	}
+
+	bool Intersect(vec3 origin, vec3 dir, RayHit &hit)
+	{
+		if (bvh.Empty())
+			BuildBVH();
+		float t = hit.t;
+		vec2 uv;
+		if (!bvh.Intersect(origin, dir, t, uv))
+			return false;
+		hit.t = t;
+		hit.uv = uv;
+		hit.position = origin + dir * t;
+		hit.normal = normalize(GenVertexData(uv.x, uv.y).normal); // exact surface normal
+		return true;
+	}
+};
+
+const unsigned int ParamSurface::restartIndex;
+
+//--------------------------- Samer
+class Bowl : public ParamSurface
+{
+	float x, y;
+	static std::vector<float> adaptiveU, adaptiveV; // shared, the quadrants are mirror images
+
+public:
+	Bowl(float _x, float _y)
+	{
+
+		this->x = _x;
+		this->y = _y;
+		if (adaptiveU.empty())
+		{
+			adaptiveU = AdaptiveKnots(tessellationError, true);
+			adaptiveV = AdaptiveKnots(tessellationError, false);
+		}
+		create(adaptiveU, adaptiveV);
+	}
+	void eval(Dnum2 &U, Dnum2 &V, Dnum2 &X, Dnum2 &Y, Dnum2 &Z)
+	{
+		//U = U * 2.0f * (float)M_PI, V = V * (float)M_PI;
+		X = U * this->x;
+		Y = V * this->y;
+		Z = Cosh(Pow(X, 2) + Pow(Y, 2));
+	}
+};
+
+std::vector<float> Bowl::adaptiveU, Bowl::adaptiveV;
+
+//---------------------------
+class Sphere : public ParamSurface
+{
+	//---------------------------
+public:
+	Sphere() { create(); }
+	bool IsSphere() { return true; }
+	void eval(Dnum2 &U, Dnum2 &V, Dnum2 &X, Dnum2 &Y, Dnum2 &Z)
+	{
+		U = U * 2.0f * (float)M_PI, V = V * (float)M_PI;
+		X = Cos(U) * Sin(V);
+		Y = Sin(U) * Sin(V);
+		Z = Cos(V);
+	}
+};
+
+//---------------------------
+class ProceduralSurface : public Geometry
+{ // no vertex data, the vertex shader evaluates the surface from gl_VertexID and gl_InstanceID
+	//---------------------------
+	unsigned int vao = 0;
+
+public:
+	enum Type
+	{
+		SPHERE = 1,
+		BOWL = 2
+	};
+
+	ProceduralSurface(Type type)
+	{
+		if (!headless)
+			glGenVertexArrays(1, &vao); // without attributes, core profile draws need one
+		surfaceType = type;
+		if (type == SPHERE)
+		{
+			boxLo = vec3(-1, -1, -1);
+			boxHi = vec3(1, 1, 1);
+			center = vec3(0, 0, 0);
+			radius = 1;
+		}
+		else
+		{
+			boxLo = vec3(0, 0, 1); // the quadrant x, y >= 0
+			boxHi = vec3(1, 1, coshf(2));
+			center = (boxLo + boxHi) / 2;
+			radius = length(boxHi - boxLo) / 2;
+		}
+	}
+
+	vec2 SurfaceTessellation(int lod)
+	{
+		int N = proceduralTessellation >> lod;
+		return vec2(N, N);
+	}
+
+	void Draw() { Draw(0); }
+
+	void Draw(int lod, int instances = 1)
+	{ // one instance per strip and mirror
+		vec2 tess = SurfaceTessellation(lod);
+		glBindVertexArray(vao);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, ((int)tess.x + 1) * 2, (int)tess.y * instances);
+		frameStats.drawCalls++;
+	}
+
+	int LodCount() { return (proceduralTessellation >> (maxLods - 1)) >= 2 ? maxLods : 1; }
+
+	bool IsSphere() { return surfaceType == SPHERE; }
+
+	unsigned int TriangleCount(int lod)
+	{
+		vec2 tess = SurfaceTessellation(lod);
+		return 2 * (unsigned int)tess.x * (unsigned int)tess.y;
+	}
+
+	~ProceduralSurface()
+	{
+		if (!headless)
+			glDeleteVertexArrays(1, &vao);
+	}
+};
+
+Geometry *CreateSphere(Arena &arena)
+{
+	if (proceduralGeometry)
+		return arena.New<ProceduralSurface>(ProceduralSurface::SPHERE);
+	return arena.New<Sphere>();
+}
+
+// the quadrant x, y >= 0, the others are its reflections
+Geometry *CreateBowl(Arena &arena)
+{
+	if (proceduralGeometry)
+		return arena.New<ProceduralSurface>(ProceduralSurface::BOWL);
+	return arena.New<Bowl>(1.0f, 1.0f);
+}
+
+//---------------------------
+struct Object
+{
+	//---------------------------
+	Shader *shader;
+	Material *material;
+	Texture *texture;
+	Geometry *geometry;
+	vec3 scale, translation, rotationAxis;
+	float rotationAngle;
+	int lod; // level of detail selected in the last frame
+	bool occluder; // drawn before the others into the depth pyramid of the occlusion culling, not tested itself
+	std::vector<vec3> mirrors; // reflections in modeling space, each drawn as an instance, empty: drawn once; at most 8
+
+public:
+	Object(Shader *_shader, Material *_material, Texture *_texture, Geometry *_geometry) : scale(vec3(1, 1, 1)), translation(vec3(0, 0, 0)), rotationAxis(0, 0, 1), rotationAngle(0), lod(0), occluder(false)
+	{
+		shader = _shader;
+		texture = _texture;
+		material = _material;
+		geometry = _geometry;
+	}
+
+	virtual void SetModelingTransform(mat4 &M, mat4 &Minv)
+	{
+		M = ScaleMatrix(scale) * RotationMatrix(rotationAngle, rotationAxis) * TranslateMatrix(translation);
+		Minv = TranslateMatrix(-translation) * RotationMatrix(-rotationAngle, rotationAxis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
+	}
+
+	void Draw(const FrameState &frame)
+	{
+		TRACE_SCOPE("Object::Draw");
+		DrawState draw;
+		Prepare(frame, draw);
+		Submit(frame, draw);
+	}
+
+	// the state of the draw, selects the level of detail
+	void Prepare(const FrameState &frame, DrawState &draw)
+	{
+		SetModelingTransform(draw.M, draw.Minv);
+		draw.MVP = draw.M * frame.VP;
+		draw.material = material;
+		draw.texture = texture;
+		draw.posScale = geometry->posScale;
+		draw.posBias = geometry->posBias;
+		draw.octNormals = geometry->octNormals;
+		SelectLod(ProjectedSize(draw.M, frame));
+		draw.surfaceType = geometry->surfaceType;
+		draw.surfaceTess = geometry->SurfaceTessellation(lod);
+		draw.mirrors = mirrors.empty() ? nullptr : &mirrors[0];
+		draw.nMirrors = mirrors.size();
+		draw.batchSize = 1;
+		draw.batchFirst = 0;
+		draw.instanceTexture = 0;
+	}
+
+	// draws this object, or the batch of draw.batchSize objects sharing its state but the transforms
+	void Submit(const FrameState &frame, const DrawState &draw)
+	{
+		{
+			static int zone = profiler.AddZone("bind");
+			ProfileScope scope(zone);
+			shader->Bind(frame, draw);
+		}
+		int instances = std::max(1, (int)mirrors.size()) * draw.batchSize;
+		geometry->Draw(lod, instances);
+		frameStats.objects += draw.batchSize;
+		frameStats.triangles += instances * geometry->TriangleCount(lod);
+		frameStats.fullTriangles += instances * geometry->TriangleCount(0);
+	}
+
+	// bounds of the geometry and all of its reflections in modeling space
+	void ModelingBounds(vec3 &center, float &radius, vec3 &lo, vec3 &hi)
+	{
+		center = geometry->center;
+		radius = geometry->radius;
+		lo = geometry->boxLo;
+		hi = geometry->boxHi;
+		if (mirrors.empty())
+			return;
+		for (unsigned int i = 0; i < mirrors.size(); i++)
+		{
+			vec3 a = geometry->boxLo * mirrors[i], b = geometry->boxHi * mirrors[i];
+			vec3 mLo(fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z)), mHi(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z));
+			lo = i == 0 ? mLo : vec3(fminf(lo.x, mLo.x), fminf(lo.y, mLo.y), fminf(lo.z, mLo.z));
+			hi = i == 0 ? mHi : vec3(fmaxf(hi.x, mHi.x), fmaxf(hi.y, mHi.y), fmaxf(hi.z, mHi.z));
+		}
+		center = (lo + hi) / 2;
+		radius = 0;
+		for (const vec3 &mirror : mirrors)
+			radius = fmaxf(radius, length(geometry->center * mirror - center) + geometry->radius);
+	}
+
+	// world space ray, the hit is returned in world space
+	bool Intersect(vec3 origin, vec3 dir, RayHit &hit)
+	{
+		mat4 M, Minv;
+		SetModelingTransform(M, Minv);
+		vec4 o = vec4(origin.x, origin.y, origin.z, 1) * Minv, d = vec4(dir.x, dir.y, dir.z, 0) * Minv;
+		RayHit local = hit;
+		bool found = false;
+		for (int i = 0; i < std::max(1, (int)mirrors.size()); i++)
+		{ // the reflected ray hits the geometry where the ray hits the reflection
+			vec3 mirror = mirrors.empty() ? vec3(1, 1, 1) : mirrors[i];
+			if (geometry->Intersect(vec3(o.x, o.y, o.z) * mirror, vec3(d.x, d.y, d.z) * mirror, local))
+			{
+				local.mirror = mirror;
+				local.normal = local.normal * mirror * (mirror.x * mirror.y * mirror.z);
+				found = true;
+			}
+		}
+		if (!found)
+			return false;
+		hit = local;
+		hit.object = this;
+		hit.position = origin + dir * hit.t;
+		vec3 n = hit.normal; // normals transform with the transposed inverse
+		hit.normal = normalize(vec3(dot(vec3(Minv[0][0], Minv[0][1], Minv[0][2]), n),
+									dot(vec3(Minv[1][0], Minv[1][1], Minv[1][2]), n),
+									dot(vec3(Minv[2][0], Minv[2][1], Minv[2][2]), n)));
+		return true;
+	}
+
+	// bounding sphere and box of the geometry in world space
+	void WorldBounds(vec3 &wCenter, float &wRadius, vec3 &wLo, vec3 &wHi)
+	{
+		mat4 M, Minv;
+		SetModelingTransform(M, Minv);
+		vec3 center, lo, hi;
+		float radius;
+		ModelingBounds(center, radius, lo, hi);
+		vec4 c = vec4(center.x, center.y, center.z, 1) * M;
+		wCenter = vec3(c.x, c.y, c.z);
+		wRadius = radius * fmaxf(fabsf(scale.x), fmaxf(fabsf(scale.y), fabsf(scale.z)));
+		vec3 boxCenter = (lo + hi) / 2, extent = (hi - lo) / 2;
+		vec4 bc = vec4(boxCenter.x, boxCenter.y, boxCenter.z, 1) * M;
+		vec3 e; // extent of the transformed box along the world axes
+		e.x = extent.x * fabsf(M[0][0]) + extent.y * fabsf(M[1][0]) + extent.z * fabsf(M[2][0]);
+		e.y = extent.x * fabsf(M[0][1]) + extent.y * fabsf(M[1][1]) + extent.z * fabsf(M[2][1]);
+		e.z = extent.x * fabsf(M[0][2]) + extent.y * fabsf(M[1][2]) + extent.z * fabsf(M[2][2]);
+		wLo = vec3(bc.x, bc.y, bc.z) - e;
+		wHi = vec3(bc.x, bc.y, bc.z) + e;
+	}
+
+	// diameter of the bounding sphere on the screen in pixels, of the nearest reflection when mirrored
+	float ProjectedSize(const mat4 &M, const FrameState &frame)
+	{
+		float maxScale = fmaxf(fabsf(scale.x), fmaxf(fabsf(scale.y), fabsf(scale.z)));
+		float size = 0;
+		for (int i = 0; i < std::max(1, (int)mirrors.size()); i++)
+		{
+			vec3 center = mirrors.empty() ? geometry->center : geometry->center * mirrors[i];
+			vec4 vCenter = vec4(center.x, center.y, center.z, 1) * M * frame.V;
+			float depth = fmaxf(-vCenter.z, 1e-3f); // camera inside or behind: full detail
+			size = fmaxf(size, 2 * geometry->radius * maxScale * frame.P[1][1] / depth * frame.height / 2);
+		}
+		return size;
+	}
+
+	// level k is used down to lodPixelSize / 2^k, switching only beyond the hysteresis margin
+	void SelectLod(float size)
+	{
+		if (!lodEnabled)
+		{
+			lod = 0;
+			return;
+		}
+		lod = (int)fminf(lod, geometry->LodCount() - 1);
+		while (lod + 1 < geometry->LodCount() && size < lodPixelSize / (1 << lod) * (1 - lodHysteresis))
+			lod++;
+		while (lod > 0 && size > lodPixelSize / (1 << (lod - 1)) * (1 + lodHysteresis))
+			lod--;
+	}
+
+	virtual void Animate(float tstart, float tend)
+	{
+		//rotationAngle = 0.8f * tend;
+	}
+
+	// moves by itself, never drawn into the static layer
+	virtual bool Dynamic() { return false; }
+	virtual ~Object() {}
+};
+
+class Ball : public Object
+{
+public:
+	static Bowl *bowl; // the quadrant x, y >= 0, the balls snap to its reflections, owned by the scene
+	vec3 direction, normal, velocity, acceleration, gravity;
+	Ball(vec3 _velocity,
+		 vec3 _normal,
+		 vec3 _direction,
 		 Shader *_shader,
 		 Material *_material,
 		 Texture *_texture,
 		 Geometry *_geometry)
 		: Object(_shader, _material, _texture, _geometry)
 	{
-		this->velocity = _velocity;
-		this->normal = _normal;
-		this->gravity = vec3(0, 0, -3);
-		this->direction = _direction;
+		this->velocity = _velocity;
+		this->normal = _normal;
+		this->gravity = vec3(0, 0, -3);
+		this->direction = _direction;
+	}
+	bool Dynamic() override { return true; }
+	void Animate(float tstart, float tend) override
+	{
+		TRACE_SCOPE("Ball::Animate");
+		this->acceleration = gravity - dot(gravity, normal) * normal;
+		this->velocity = this->velocity + this->acceleration * 0.001f * tend;
+		this->direction = this->direction + this->velocity * 0.001f * tend;
+		// snap to the bowl
+		vec3 mirror(this->direction.x < 0 ? -1 : 1, this->direction.y < 0 ? -1 : 1, 1);
+		normal = bowl->GenVertexData(abs(this->direction.x), abs(this->direction.y)).normal * mirror * (mirror.x * mirror.y);
+		normal = normal / magnitude(normal);
+		vec3 position = (2 * height(this->direction.x, this->direction.y) + 0.1 * normal);
+		this->translation = vec3(position.x, position.y, position.z);
+
+		// printf("%f , %f , %f\n",
+		// 	   this->translation.x,
+		// 	   this->translation.y,
+		// 	   this->translation.z);
+	}
+};
+
+Bowl *Ball::bowl;
+
+//---------------------------
+class DrawBatches
+{ // objects that differ only in their transform are drawn by one instanced call, the transforms are in a buffer texture
+	//---------------------------
+	struct Item
+	{
+		Object *object;
+		DrawState draw;
+	};
+	static const unsigned int maxObjects = 8192; // 8 texels each, the minimum buffer texture size is 65536 texels
+	std::vector<Item> items;
+	std::vector<vec4> instanceData; // rows of M and Minv per object
+	unsigned int buffer = 0, texture = 0;
+
+	// everything but the transform is shared by a batch
+	static bool Same(const Item &a, const Item &b)
+	{
+		return a.object->shader == b.object->shader && a.object->geometry == b.object->geometry && a.object->lod == b.object->lod &&
+			   a.object->material == b.object->material && a.object->texture == b.object->texture;
+	}
+
+	static bool Less(const Item &a, const Item &b)
+	{
+		const Object *p = a.object, *q = b.object;
+		if (p->shader != q->shader)
+			return p->shader < q->shader;
+		if (p->geometry != q->geometry)
+			return p->geometry < q->geometry;
+		if (p->lod != q->lod)
+			return p->lod < q->lod;
+		if (p->material != q->material)
+			return p->material < q->material;
+		return p->texture < q->texture;
+	}
+
+public:
+	int batches = 0; // draws of more than one object in the last frame
+
+	// collects the object if its shader draws batches, mirrored objects keep their mirrors in uniforms and are drawn alone
+	bool Add(Object *obj, const FrameState &frame)
+	{
+		if (!obj->shader->Batches() || !obj->mirrors.empty() || items.size() == maxObjects)
+			return false;
+		items.push_back(Item());
+		items.back().object = obj;
+		obj->Prepare(frame, items.back().draw);
+		return true;
+	}
+
+	void Draw(const FrameState &frame)
+	{
+		batches = 0;
+		if (items.empty())
+			return;
+		std::sort(items.begin(), items.end(), Less);
+		instanceData.clear();
+		for (const Item &item : items)
+		{
+			for (int i = 0; i < 4; i++)
+				instanceData.push_back(item.draw.M[i]);
+			for (int i = 0; i < 4; i++)
+				instanceData.push_back(item.draw.Minv[i]);
+		}
+		if (!buffer)
+		{
+			glGenBuffers(1, &buffer);
+			glGenTextures(1, &texture);
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+		glBufferData(GL_TEXTURE_BUFFER, instanceData.size() * sizeof(vec4), &instanceData[0], GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_BUFFER, texture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		for (unsigned int first = 0; first < items.size();)
+		{
+			unsigned int last = first + 1;
+			while (last < items.size() && Same(items[first], items[last]))
+				last++;
+			DrawState &draw = items[first].draw;
+			draw.batchSize = last - first;
+			draw.batchFirst = first;
+			draw.instanceTexture = texture;
+			items[first].object->Submit(frame, draw);
+			batches += draw.batchSize > 1;
+			first = last;
+		}
+		items.clear();
+	}
+
+	void Release()
+	{
+		if (!buffer)
+			return;
+		glDeleteTextures(1, &texture);
+		glDeleteBuffers(1, &buffer);
+		buffer = texture = 0;
+	}
+};
+
+//---------------------------
+class FrustumCuller
+{ // bounding spheres of all objects against the planes of the frustum four at a time, then boxes of the survivors
+	//---------------------------
+	vec4 planes[6];							 // inside: dot(plane, (p, 1)) >= 0
+	std::vector<float> cx, cy, cz, radius;	 // bounding spheres, structure of arrays
+	std::vector<vec3> boxLo, boxHi;
+
+	// Gribb-Hartmann: the planes are sums and differences of the columns of the view-projection matrix
+	void ExtractPlanes(const mat4 &VP)
+	{
+		vec4 col[4];
+		for (int j = 0; j < 4; j++)
+			col[j] = vec4(VP[0][j], VP[1][j], VP[2][j], VP[3][j]);
+		for (int i = 0; i < 3; i++)
+		{
+			planes[2 * i] = col[3] + col[i];
+			planes[2 * i + 1] = col[3] - col[i];
+		}
+		for (vec4 &plane : planes)
+			plane = plane / length(vec3(plane.x, plane.y, plane.z));
+	}
+
+	bool BoxVisible(const vec3 &lo, const vec3 &hi)
+	{
+		for (const vec4 &plane : planes)
+		{ // corner furthest along the normal
+			vec3 p(plane.x >= 0 ? hi.x : lo.x, plane.y >= 0 ? hi.y : lo.y, plane.z >= 0 ? hi.z : lo.z);
+			if (plane.x * p.x + plane.y * p.y + plane.z * p.z + plane.w < 0)
+				return false;
+		}
+		return true;
+	}
+
+public:
+	std::vector<unsigned char> visible;
+
+	void Cull(const std::vector<Object *> &objects, const mat4 &VP)
+	{
+		ExtractPlanes(VP);
+		unsigned int n = objects.size(), padded = (n + 3) & ~3u;
+		cx.assign(padded, 0);
+		cy.assign(padded, 0);
+		cz.assign(padded, 0);
+		radius.assign(padded, 0);
+		boxLo.resize(n);
+		boxHi.resize(n);
+		visible.resize(padded);
+		for (unsigned int i = 0; i < n; i++)
+		{
+			vec3 c;
+			objects[i]->WorldBounds(c, radius[i], boxLo[i], boxHi[i]);
+			cx[i] = c.x;
+			cy[i] = c.y;
+			cz[i] = c.z;
+		}
+#if defined(__SSE__)
+		for (unsigned int i = 0; i < padded; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(&cx[i]), y = _mm_loadu_ps(&cy[i]), z = _mm_loadu_ps(&cz[i]), r = _mm_loadu_ps(&radius[i]);
+			__m128 zero = _mm_setzero_ps(), inside = _mm_cmpeq_ps(zero, zero);
+			for (const vec4 &plane : planes)
+			{
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+									  _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), zero));
+			}
+			int mask = _mm_movemask_ps(inside);
+			for (int k = 0; k < 4; k++)
+				visible[i + k] = (mask >> k) & 1;
+		}
+#else
+		for (unsigned int i = 0; i < n; i++)
+		{
+			visible[i] = 1;
+			for (const vec4 &plane : planes)
+				if (plane.x * cx[i] + plane.y * cy[i] + plane.z * cz[i] + plane.w + radius[i] < 0)
+					visible[i] = 0;
+		}
+#endif
+		for (unsigned int i = 0; i < n; i++)
+			if (visible[i] && !BoxVisible(boxLo[i], boxHi[i]))
+				visible[i] = 0;
+	}
+};
+
+//---------------------------
+class OcclusionCuller
+{ // hierarchical z: the depth of the occluders is reduced to the farthest value of 2x2 texels on the GPU down to a coarse level,
+  // which is read back, the coarser levels are built on the CPU, the screen rectangles of the bounding spheres are tested
+	//---------------------------
+	static const int readbackSize = 128; // texels along the longer side at most, the read waits until the occluders are drawn
+	struct Level
+	{
+		unsigned int texture = 0, fbo = 0;
+		int width = 0, height = 0;
+	};
+	struct Grid
+	{
+		int width = 0, height = 0;
+		std::vector<float> depth; // farthest window space depth per texel, rows from the bottom
+	};
+	std::vector<Level> levels; // on the GPU, halved from the viewport
+	std::vector<Grid> grids;   // on the CPU, halved from the read level down to one texel
+	unsigned int depthTexture = 0, vao = 0;
+	GPUProgram *reduceProgram = nullptr;
+	int width = 0, height = 0; // of the viewport
+	int shift = 0;			   // a texel of grids[0] covers 1 << shift pixels along both axes
+	mat4 V, P;
+
+	void FreeLevels()
+	{
+		for (Level &level : levels)
+		{
+			glDeleteFramebuffers(1, &level.fbo);
+			glDeleteTextures(1, &level.texture);
+		}
+		levels.clear();
+		if (depthTexture)
+		{
+			glDeleteTextures(1, &depthTexture);
+			glDeleteVertexArrays(1, &vao);
+			depthTexture = vao = 0;
+		}
+		width = height = 0;
+	}
+
+	void Allocate(int _width, int _height)
+	{
+		FreeLevels();
+		width = _width;
+		height = _height;
+		if (!reduceProgram)
+		{
+			const char *vertexSource = R"(
+				#version 330
+				void main() { gl_Position = vec4(gl_VertexID == 1 ? 3 : -1, gl_VertexID == 2 ? 3 : -1, 0, 1); } // covers the viewport
+			)";
+			const char *fragmentSource = R"(
+				#version 330
+				uniform sampler2D source; // the depth or the finer level
+				out float farthest;
+				void main() {
+					ivec2 last = textureSize(source, 0) - 1, p = 2 * ivec2(gl_FragCoord.xy); // odd sizes: the last texel is its own pair
+					farthest = max(max(texelFetch(source, min(p, last), 0).r, texelFetch(source, min(p + ivec2(1, 0), last), 0).r),
+								   max(texelFetch(source, min(p + ivec2(0, 1), last), 0).r, texelFetch(source, min(p + ivec2(1, 1), last), 0).r));
+				}
+			)";
+			reduceProgram = new GPUProgram();
+			reduceProgram->create(vertexSource, fragmentSource, "farthest");
+		}
+		glGenVertexArrays(1, &vao);
+		glGenTextures(1, &depthTexture);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		int w = width, h = height;
+		shift = 0;
+		do
+		{
+			w = (w + 1) / 2;
+			h = (h + 1) / 2;
+			shift++;
+			Level level;
+			level.width = w;
+			level.height = h;
+			glGenTextures(1, &level.texture);
+			glBindTexture(GL_TEXTURE_2D, level.texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, w, h, 0, GL_RED, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glGenFramebuffers(1, &level.fbo);
+			glBindFramebuffer(GL_FRAMEBUFFER, level.fbo);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, level.texture, 0);
+			levels.push_back(level);
+		} while (std::max(w, h) > readbackSize);
+		grids.clear();
+		do
+		{
+			grids.push_back(Grid());
+			grids.back().width = w;
+			grids.back().height = h;
+			grids.back().depth.resize(w * h);
+			w = (w + 1) / 2;
+			h = (h + 1) / 2;
+		} while (grids.back().width > 1 || grids.back().height > 1);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+public:
+	unsigned int tested = 0, occluded = 0; // objects of the last frame
+
+	// after the occluders are drawn into the bound framebuffer, the viewport is width x height at its origin
+	void Build(int _width, int _height, const mat4 &_V, const mat4 &_P)
+	{
+		TRACE_SCOPE("OcclusionCuller::Build");
+		V = _V;
+		P = _P;
+		tested = occluded = 0;
+		GLint framebuffer;
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+		if (_width != width || _height != height)
+			Allocate(_width, _height);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height); // from the depth buffer for a depth texture
+
+		reduceProgram->Use();
+		reduceProgram->setUniform(0, "source");
+		glBindVertexArray(vao);
+		glDisable(GL_DEPTH_TEST);
+		for (const Level &level : levels)
+		{
+			glBindFramebuffer(GL_FRAMEBUFFER, level.fbo);
+			glViewport(0, 0, level.width, level.height);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			glBindTexture(GL_TEXTURE_2D, level.texture);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, grids[0].width, grids[0].height, GL_RED, GL_FLOAT, &grids[0].depth[0]);
+		glEnable(GL_DEPTH_TEST);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, width, height);
+
+		for (unsigned int l = 1; l < grids.size(); l++)
+		{
+			const Grid &fine = grids[l - 1];
+			Grid &coarse = grids[l];
+			for (int y = 0; y < coarse.height; y++)
+				for (int x = 0; x < coarse.width; x++)
+				{
+					int x0 = 2 * x, y0 = 2 * y, x1 = std::min(x0 + 1, fine.width - 1), y1 = std::min(y0 + 1, fine.height - 1);
+					coarse.depth[y * coarse.width + x] = std::max(std::max(fine.depth[y0 * fine.width + x0], fine.depth[y0 * fine.width + x1]),
+																  std::max(fine.depth[y1 * fine.width + x0], fine.depth[y1 * fine.width + x1]));
+				}
+		}
+	}
+
+	// the nearest depth of the bounding sphere is behind the farthest occluder depth of all texels under its screen rectangle,
+	// the level is chosen where the rectangle spans at most 2x2 texels
+	bool Occluded(Object *obj)
+	{
+		vec3 center, boxLo, boxHi;
+		float r;
+		obj->WorldBounds(center, r, boxLo, boxHi);
+		tested++;
+		vec4 p = vec4(center.x, center.y, center.z, 1) * V;
+		float d = -p.z; // distance in front of the camera
+		if (d - r <= 1e-3f)
+			return false; // crosses the eye plane
+		int rect[4];
+		for (int axis = 0; axis < 2; axis++)
+		{ // the box of the sphere in view space projected like LightGrid::Rect
+			float c = axis == 0 ? p.x : p.y, scale = P[axis][axis], size = axis == 0 ? (float)width : (float)height;
+			float lo = scale * (c - r) / (c - r < 0 ? d - r : d + r), hi = scale * (c + r) / (c + r > 0 ? d - r : d + r);
+			rect[axis] = std::max(0, (int)floorf((lo * 0.5f + 0.5f) * size)) >> shift;
+			rect[axis + 2] = std::min((int)size - 1, (int)floorf((hi * 0.5f + 0.5f) * size)) >> shift;
+			if (rect[axis] > rect[axis + 2])
+				return false; // off the screen, left to the frustum culling
+		}
+		float z = -(d - r), depth = (z * P[2][2] + P[3][2]) / -z * 0.5f + 0.5f; // of the nearest point
+		unsigned int l = 0;
+		while (l + 1 < grids.size() && ((rect[2] >> l) - (rect[0] >> l) > 1 || (rect[3] >> l) - (rect[1] >> l) > 1))
+			l++;
+		const Grid &grid = grids[l];
+		for (int y = rect[1] >> l; y <= rect[3] >> l; y++)
+			for (int x = rect[0] >> l; x <= rect[2] >> l; x++)
+				if (depth <= grid.depth[y * grid.width + x])
+					return false;
+		occluded++;
+		return true;
+	}
+
+	void Release()
+	{
+		FreeLevels();
+		delete reduceProgram;
+		reduceProgram = nullptr;
+	}
+};
+
+//---------------------------
+class SphereImpostors
+{ // all spheres of a frame in one instanced draw call
+	//---------------------------
+	struct Instance
+	{
+		vec4 centerRadius, kdShininess;
+		vec3 ks, ka;
+	};
+
+	unsigned int vao, vbo;
+	ImpostorShader shader;
+	std::vector<Instance> instances;
+	unsigned int fullTriangles;
+
+public:
+	SphereImpostors()
+	{
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glGenBuffers(1, &vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		for (int i = 0; i < 4; i++)
+		{
+			glEnableVertexAttribArray(i);
+			glVertexAttribDivisor(i, 1); // advance once per quad
+		}
+		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void *)offsetof(Instance, centerRadius));
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void *)offsetof(Instance, kdShininess));
+		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void *)offsetof(Instance, ks));
+		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void *)offsetof(Instance, ka));
+		fullTriangles = 0;
+	}
+
+	// collects the object if it is a uniformly scaled sphere
+	bool Add(Object *obj)
+	{
+		if (!obj->geometry->IsSphere() || obj->scale.x != obj->scale.y || obj->scale.x != obj->scale.z)
+			return false;
+		mat4 M, Minv;
+		obj->SetModelingTransform(M, Minv);
+		vec4 center = vec4(obj->geometry->center.x, obj->geometry->center.y, obj->geometry->center.z, 1) * M;
+		const Material &material = *obj->material;
+		Instance instance;
+		instance.centerRadius = vec4(center.x, center.y, center.z, obj->geometry->radius * fabsf(obj->scale.x));
+		instance.kdShininess = vec4(material.kd.x, material.kd.y, material.kd.z, material.shininess);
+		instance.ks = material.ks;
+		instance.ka = material.ka;
+		instances.push_back(instance);
+		fullTriangles += obj->geometry->TriangleCount(0);
+		return true;
+	}
+
+	void Draw(const FrameState &frame)
+	{
+		if (!instances.empty())
+		{
+			shader.Bind(frame);
+			glBindVertexArray(vao);
+			glBindBuffer(GL_ARRAY_BUFFER, vbo);
+			glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(Instance), &instances[0], GL_STREAM_DRAW);
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instances.size());
+			frameStats.objects += instances.size();
+			frameStats.drawCalls++;
+			frameStats.triangles += 2 * instances.size();
+			frameStats.fullTriangles += fullTriangles;
+		}
+		instances.clear();
+		fullTriangles = 0;
+	}
+
+	~SphereImpostors()
+	{
+		glDeleteBuffers(1, &vbo);
+		glDeleteVertexArrays(1, &vao);
+	}
+};
+
+//---------------------------
+class GpuBalls
+{ // ball states in two buffers, advanced on the GPU and drawn as impostors from the same buffer
+	//---------------------------
+	struct State
+	{
+		vec4 position, direction, velocity, normal; // position.w is the radius
+	};
+
+	unsigned int vbo[2], updateVao[2], renderVao[2];
+	int current; // buffer holding the latest states
+	unsigned int nBalls, capacity;
+	BallPhysicsProgram physics;
+	ImpostorShader shader;
+
+	void setupVaos(int i)
+	{
+		glBindVertexArray(updateVao[i]);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo[i]);
+		for (int j = 0; j < 4; j++)
+		{
+			glEnableVertexAttribArray(j);
+			glVertexAttribPointer(j, 4, GL_FLOAT, GL_FALSE, sizeof(State), (void *)(j * sizeof(vec4)));
+		}
+		glBindVertexArray(renderVao[i]); // only the sphere is per instance, the material is constant
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(State), (void *)offsetof(State, position));
+		glVertexAttribDivisor(0, 1);
+	}
+
+	void reserve(unsigned int n)
+	{
+		if (n <= capacity)
+			return;
+		unsigned int newCapacity = capacity * 2 > n ? capacity * 2 : n;
+		for (int i = 0; i < 2; i++)
+		{
+			unsigned int buffer;
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferData(GL_COPY_WRITE_BUFFER, newCapacity * sizeof(State), NULL, GL_DYNAMIC_COPY);
+			if (i == current && nBalls > 0)
+			{
+				glBindBuffer(GL_COPY_READ_BUFFER, vbo[i]);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, nBalls * sizeof(State));
+			}
+			if (vbo[i])
+				glDeleteBuffers(1, &vbo[i]);
+			vbo[i] = buffer;
+			setupVaos(i);
+		}
+		capacity = newCapacity;
+	}
+
+public:
+	Material material; // shared by all simulated balls
+
+	unsigned int Count() { return nBalls; }
+
+	GpuBalls() : current(0), nBalls(0), capacity(0)
+	{
+		TRACE_SCOPE("create GpuBalls");
+		vbo[0] = vbo[1] = 0; // created by reserve
+		glGenVertexArrays(2, updateVao);
+		glGenVertexArrays(2, renderVao);
+		reserve(1024);
+	}
+
+	void Add(vec3 velocity, vec3 normal, vec3 direction, vec3 position, float radius)
+	{
+		reserve(nBalls + 1);
+		State state;
+		state.position = vec4(position.x, position.y, position.z, radius);
+		state.direction = vec4(direction.x, direction.y, direction.z, 0);
+		state.velocity = vec4(velocity.x, velocity.y, velocity.z, 0);
+		state.normal = vec4(normal.x, normal.y, normal.z, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo[current]);
+		glBufferSubData(GL_ARRAY_BUFFER, nBalls * sizeof(State), sizeof(State), &state);
+		nBalls++;
+	}
+
+	// the latest state of a ball read back from the GPU, for the checks
+	void Read(unsigned int i, vec3 &position, vec3 &direction)
+	{
+		State state;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo[current]);
+		glGetBufferSubData(GL_ARRAY_BUFFER, i * sizeof(State), sizeof(State), &state);
+		position = vec3(state.position.x, state.position.y, state.position.z);
+		direction = vec3(state.direction.x, state.direction.y, state.direction.z);
+	}
+
+	void Animate(float tstart, float tend)
+	{
+		if (nBalls == 0)
+			return;
+		physics.Use();
+		physics.setUniform(tend, "tend");
+		glEnable(GL_RASTERIZER_DISCARD);
+		glBindVertexArray(updateVao[current]);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vbo[1 - current]);
+		glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, nBalls);
+		glEndTransformFeedback();
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+		glDisable(GL_RASTERIZER_DISCARD);
+		current = 1 - current;
+	}
+
+	void Draw(const FrameState &frame)
+	{
+		if (nBalls == 0)
+			return;
+		shader.Bind(frame);
+		glBindVertexArray(renderVao[current]);
+		glVertexAttrib4f(1, material.kd.x, material.kd.y, material.kd.z, material.shininess);
+		glVertexAttrib3f(2, material.ks.x, material.ks.y, material.ks.z);
+		glVertexAttrib3f(3, material.ka.x, material.ka.y, material.ka.z);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, nBalls);
+		frameStats.objects += nBalls;
+		frameStats.drawCalls++;
+		frameStats.triangles += 2 * nBalls;
+		frameStats.fullTriangles += 2 * nBalls;
+	}
+
+	~GpuBalls()
+	{
+		glDeleteBuffers(2, vbo);
+		glDeleteVertexArrays(2, updateVao);
+		glDeleteVertexArrays(2, renderVao);
+	}
+};
+
+//---------------------------
+class BallCollisions
+{ // sorted cell grid over the (x, y) domain of the bowl, cells are as large as a ball
+	//---------------------------
+public:
+	struct Body
+	{
+		vec3 position, velocity; // velocity in the parameter domain of Ball::direction
+		vec2 push;				 // separation of the overlap in world space
+	};
+
+	float radius;
+	unsigned long long pairTests, contacts; // of the last step, every pair is tested from both sides
+
+private:
+	std::vector<unsigned long long> keys, sortedKeys;
+	std::vector<unsigned int> order;					   // bodies sorted by cell, kept between steps
+	std::vector<vec3> sortedPositions, sortedVelocities; // contiguous copies in cell order
+	std::vector<vec3> velocities;
+	std::vector<vec2> pushes;
+
+	// row major cell index, neighboring cells of a row have consecutive keys
+	unsigned long long CellKey(int ix, int iy)
+	{
+		return ((unsigned long long)(unsigned int)(iy + 0x40000000) << 32) | (unsigned int)(ix + 0x40000000);
+	}
+
+	unsigned long long CellKey(const vec3 &p)
+	{
+		float cellSize = 2 * radius;
+		return CellKey((int)floorf(p.x / cellSize), (int)floorf(p.y / cellSize));
+	}
+
+	// balls move little between substeps, so the previous order is almost sorted
+	void Sort(const std::vector<Body> &bodies)
+	{
+		unsigned int n = bodies.size();
+		keys.resize(n);
+		for (unsigned int i = 0; i < n; i++)
+			keys[i] = CellKey(bodies[i].position);
+		if (order.size() != n)
+		{
+			order.resize(n);
+			for (unsigned int i = 0; i < n; i++)
+				order[i] = i;
+			std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return keys[a] < keys[b]; });
+		}
+		else
+		{
+			unsigned long long moves = 0;
+			for (unsigned int i = 1; i < n && moves <= 8ull * n; i++) // insertion sort
+			{
+				unsigned int body = order[i];
+				unsigned int j = i;
+				for (; j > 0 && keys[order[j - 1]] > keys[body]; j--, moves++)
+					order[j] = order[j - 1];
+				order[j] = body;
+			}
+			if (moves > 8ull * n) // too much changed, start over
+				std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return keys[a] < keys[b]; });
+		}
+		sortedKeys.resize(n);
+		sortedPositions.resize(n);
+		sortedVelocities.resize(n);
+		for (unsigned int a = 0; a < n; a++)
+		{
+			sortedKeys[a] = keys[order[a]];
+			sortedPositions[a] = bodies[order[a]].position;
+			sortedVelocities[a] = bodies[order[a]].velocity;
+		}
+	}
+
+	unsigned int LowerBound(unsigned long long key)
+	{
+		return std::lower_bound(sortedKeys.begin(), sortedKeys.end(), key) - sortedKeys.begin();
+	}
+
+	unsigned int UpperBound(unsigned long long key)
+	{
+		return std::upper_bound(sortedKeys.begin(), sortedKeys.end(), key) - sortedKeys.begin();
+	}
+
+	// bodies order[first, last) against the 3x3 neighborhood of their cells, writes only their own results
+	void Collide(unsigned int first, unsigned int last, unsigned long long &tests, unsigned long long &hits)
+	{
+		float cellSize = 2 * radius;
+		unsigned int n = order.size();
+		unsigned int rows[3][2]; // ranges of the 3 neighboring cells in the rows below, at and above
+		for (unsigned int cellBegin = first, cellEnd; cellBegin < last; cellBegin = cellEnd)
+		{
+			unsigned long long key = sortedKeys[cellBegin];
+			for (cellEnd = cellBegin; cellEnd < last && sortedKeys[cellEnd] == key;)
+				cellEnd++;
+			const vec3 &p = sortedPositions[cellBegin];
+			int ix = (int)floorf(p.x / cellSize), iy = (int)floorf(p.y / cellSize);
+			for (int r = 0; r < 3; r++)
+			{
+				unsigned long long lo = CellKey(ix - 1, iy + r - 1), hi = CellKey(ix + 1, iy + r - 1);
+				if (cellBegin == first)
+				{
+					rows[r][0] = LowerBound(lo);
+					rows[r][1] = UpperBound(hi);
+					continue;
+				}
+				// the cells are visited in key order, so the ranges only move forward
+				while (rows[r][0] < n && sortedKeys[rows[r][0]] < lo)
+					rows[r][0]++;
+				while (rows[r][1] < n && sortedKeys[rows[r][1]] <= hi)
+					rows[r][1]++;
+			}
+			for (unsigned int a = cellBegin; a < cellEnd; a++)
+			{
+				vec3 velocity = sortedVelocities[a];
+				vec2 push(0, 0);
+				for (int r = 0; r < 3; r++)
+					for (unsigned int b = rows[r][0]; b < rows[r][1]; b++)
+					{
+						if (a == b)
+							continue;
+						tests++;
+						vec3 d = sortedPositions[a] - sortedPositions[b];
+						float dist2 = dot(d, d);
+						if (dist2 >= 4 * radius * radius)
+							continue;
+						vec2 n(d.x, d.y); // the balls move in the (x, y) domain
+						if (dot(n, n) == 0)
+							continue;
+						hits++;
+						n = normalize(n);
+						vec3 relative = sortedVelocities[a] - sortedVelocities[b];
+						float approach = dot(vec2(relative.x, relative.y), n);
+						if (approach < 0) // elastic response of equal masses
+							velocity = velocity - vec3(n.x, n.y, 0) * approach;
+						push = push + n * ((2 * radius - sqrtf(dist2)) / 2);
+					}
+				velocities[order[a]] = velocity;
+				pushes[order[a]] = push;
+			}
+		}
+	}
+
+public:
+	BallCollisions(float _radius = 0.1f) : radius(_radius), pairTests(0), contacts(0) {}
+
+	void Step(std::vector<Body> &bodies)
+	{
+		unsigned int n = bodies.size();
+		pairTests = contacts = 0;
+		if (n < 2)
+			return;
+		Sort(bodies);
+		velocities.resize(n);
+		pushes.resize(n);
+		std::vector<unsigned long long> tests(std::max(1u, std::thread::hardware_concurrency()), 0), hits(tests.size(), 0);
+		ParallelFor(n, 4096, [&](unsigned int first, unsigned int last, unsigned int thread) {
+			// the ranges are moved to cell boundaries so that every cell is owned by one thread
+			while (first > 0 && first < n && sortedKeys[first] == sortedKeys[first - 1])
+				first++;
+			while (last < n && sortedKeys[last] == sortedKeys[last - 1])
+				last++;
+			Collide(first, last, tests[thread], hits[thread]);
+		});
+		for (unsigned int t = 0; t < tests.size(); t++)
+		{
+			pairTests += tests[t];
+			contacts += hits[t];
+		}
+		for (unsigned int i = 0; i < n; i++)
+		{
+			bodies[i].velocity = velocities[i];
+			bodies[i].push = pushes[i];
+		}
+	}
+};
+
+//---------------------------
+class SceneFile
+{ // versioned binary scene: a header and the tables of materials, lights and objects, mapped into memory and read in place
+	//---------------------------
+public:
+	static const unsigned int magic = 0x314e4353; // "SCN1"
+	static const unsigned int version = 1;		  // of the layout of the records
+	enum { SHADER_GOURAUD, SHADER_BOWL, SHADER_PHONG, SHADER_NPR, SHADERS };
+	enum { TEXTURE_CHECKER, TEXTURE_BOWL, TEXTURES }; // every object has one, the textured shaders sample it
+	enum { GEOMETRY_SPHERE, GEOMETRY_BOWL, GEOMETRIES };
+
+	struct CameraRecord
+	{
+		float eye[3], lookat[3], up[3], fov; // fov in degrees
+	};
+	struct MaterialRecord
+	{
+		float kd[3], ks[3], ka[3], shininess;
+	};
+	struct LightRecord
+	{
+		float La[3], Le[3], position[4], range; // position with w = 0 is a direction
+	};
+	struct ObjectRecord
+	{
+		unsigned char shader, texture, geometry, mirrors; // bit i of mirrors adds the reflection MirrorSigns(i)
+		unsigned int material;							  // index into the material table
+		float translation[3], scale[3], axis[3], angle;
+	};
+	struct Header
+	{
+		unsigned int magic, version, headerSize;
+		unsigned int materialSize, lightSize, objectSize; // of the records, a layout change without a version bump is refused
+		unsigned int nMaterials, nLights, nObjects, reserved;
+		unsigned long long materialOffset, lightOffset, objectOffset; // from the start of the file, 8 byte aligned
+		CameraRecord camera;
+	};
+
+private:
+	void *mapping = nullptr;
+	size_t size = 0;
+#if defined(_WIN32)
+	std::vector<unsigned long long> buffer; // no mmap, the file is read at once
+#endif
+
+	bool Table(unsigned long long offset, unsigned int count, unsigned int recordSize)
+	{
+		return offset % 8 == 0 && offset <= size && count <= (size - offset) / recordSize;
+	}
+
+	const char *Validate()
+	{
+		if (size < sizeof(Header) || header->magic != magic)
+			return "not a binary scene";
+		if (header->version != version)
+			return "unsupported version";
+		if (header->headerSize != sizeof(Header) || header->materialSize != sizeof(MaterialRecord) ||
+			header->lightSize != sizeof(LightRecord) || header->objectSize != sizeof(ObjectRecord))
+			return "record layout mismatch";
+		if (!Table(header->materialOffset, header->nMaterials, sizeof(MaterialRecord)) ||
+			!Table(header->lightOffset, header->nLights, sizeof(LightRecord)) ||
+			!Table(header->objectOffset, header->nObjects, sizeof(ObjectRecord)))
+			return "table beyond the end of the file";
+		const char *base = (const char *)mapping;
+		materials = (const MaterialRecord *)(base + header->materialOffset);
+		lights = (const LightRecord *)(base + header->lightOffset);
+		objects = (const ObjectRecord *)(base + header->objectOffset);
+		for (unsigned int i = 0; i < header->nObjects; i++)
+		{
+			const ObjectRecord &o = objects[i];
+			if (o.shader >= SHADERS || o.texture >= TEXTURES || o.geometry >= GEOMETRIES || o.material >= header->nMaterials)
+				return "object with an unknown shader, texture, geometry or material";
+		}
+		return nullptr;
+	}
+
+	static int Lookup(const char *word, const char *(*name)(int), int n)
+	{
+		for (int i = 0; i < n; i++)
+			if (strcmp(word, name(i)) == 0)
+				return i;
+		return -1;
+	}
+
+public:
+	const Header *header = nullptr;
+	const MaterialRecord *materials = nullptr;
+	const LightRecord *lights = nullptr;
+	const ObjectRecord *objects = nullptr;
+
+	static const char *ShaderName(int i)
+	{
+		static const char *names[SHADERS] = {"gouraud", "bowl", "phong", "npr"};
+		return names[i];
+	}
+	static const char *TextureName(int i)
+	{
+		static const char *names[TEXTURES] = {"checker", "bowl"};
+		return names[i];
+	}
+	static const char *GeometryName(int i)
+	{
+		static const char *names[GEOMETRIES] = {"sphere", "bowl"};
+		return names[i];
+	}
+	static vec3 MirrorSigns(int i) { return vec3(i & 2 ? -1.0f : 1.0f, i & 1 ? -1.0f : 1.0f, 1); } // the quadrants of the bowl
+
+	~SceneFile() { Close(); }
+
+	// maps a binary scene, a text scene is converted to <path>.bin first, false with a message for an invalid file
+	bool Open(const char *path)
+	{
+		Close();
+		FILE *file = fopen(path, "rb");
+		if (!file)
+		{
+			printf("Cannot open scene %s\n", path);
+			return false;
+		}
+		unsigned int first = 0;
+		bool binary = fread(&first, sizeof(first), 1, file) == 1 && first == magic;
+		if (!binary)
+		{
+			fclose(file);
+			std::string converted = std::string(path) + ".bin";
+			return Convert(path, converted.c_str()) && Open(converted.c_str());
+		}
+#if defined(_WIN32)
+		fseek(file, 0, SEEK_END);
+		size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		buffer.resize((size + 7) / 8);
+		bool read = fread(buffer.data(), 1, size, file) == size;
+		fclose(file);
+		if (!read)
+		{
+			printf("Cannot read scene %s\n", path);
+			Close();
+			return false;
+		}
+		mapping = buffer.data();
+#else
+		fclose(file);
+		int fd = open(path, O_RDONLY);
+		struct stat status;
+		if (fd < 0 || fstat(fd, &status) != 0)
+		{
+			printf("Cannot open scene %s\n", path);
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+		size = status.st_size;
+		void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd); // the mapping keeps the file
+		if (p == MAP_FAILED)
+		{
+			printf("Cannot map scene %s\n", path);
+			size = 0;
+			return false;
+		}
+		mapping = p;
+		madvise(mapping, size, MADV_SEQUENTIAL);
+#endif
+		header = (const Header *)mapping;
+		if (const char *error = Validate())
+		{
+			printf("%s: %s\n", path, error);
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+#if defined(_WIN32)
+		buffer.clear();
+		buffer.shrink_to_fit();
+#else
+		if (mapping)
+			munmap(mapping, size);
+#endif
+		mapping = nullptr;
+		size = 0;
+		header = nullptr;
+		materials = nullptr;
+		lights = nullptr;
+		objects = nullptr;
+	}
+
+	// the tables follow the header in this order, each 8 byte aligned
+	static bool Write(const char *path, const CameraRecord &camera, const std::vector<MaterialRecord> &materials,
+					  const std::vector<LightRecord> &lights, const std::vector<ObjectRecord> &objects)
+	{
+		FILE *file = fopen(path, "wb");
+		if (!file)
+		{
+			printf("Cannot write scene %s\n", path);
+			return false;
+		}
+		auto align = [](unsigned long long offset)
+		{ return (offset + 7) & ~7ULL; };
+		Header h = {}; // the padding and reserved words are written as zeros
+		h.magic = magic;
+		h.version = version;
+		h.headerSize = sizeof(Header);
+		h.materialSize = sizeof(MaterialRecord);
+		h.lightSize = sizeof(LightRecord);
+		h.objectSize = sizeof(ObjectRecord);
+		h.nMaterials = (unsigned int)materials.size();
+		h.nLights = (unsigned int)lights.size();
+		h.nObjects = (unsigned int)objects.size();
+		h.materialOffset = align(sizeof(Header));
+		h.lightOffset = align(h.materialOffset + materials.size() * sizeof(MaterialRecord));
+		h.objectOffset = align(h.lightOffset + lights.size() * sizeof(LightRecord));
+		h.camera = camera;
+		static const char zeros[8] = {};
+		unsigned long long written = 0;
+		auto put = [&](unsigned long long offset, const void *data, size_t bytes)
+		{
+			fwrite(zeros, 1, offset - written, file);
+			fwrite(data, 1, bytes, file);
+			written = offset + bytes;
+		};
+		put(0, &h, sizeof(h));
+		put(h.materialOffset, materials.data(), materials.size() * sizeof(MaterialRecord));
+		put(h.lightOffset, lights.data(), lights.size() * sizeof(LightRecord));
+		put(h.objectOffset, objects.data(), objects.size() * sizeof(ObjectRecord));
+		bool ok = !ferror(file);
+		ok &= fclose(file) == 0;
+		if (!ok)
+			printf("Cannot write scene %s\n", path);
+		return ok;
+	}
+
+	// text scene, one record per line, # starts a comment:
+	//   camera eye.xyz lookat.xyz up.xyz [fov]
+	//   material kd.rgb ks.rgb ka.rgb shininess
+	//   light La.rgb Le.rgb position.xyzw range
+	//   object shader texture geometry material translation.xyz scale.xyz axis.xyz angle [mirrors]
+	// the materials are numbered from 0 in the order of the file
+	static bool Convert(const char *textPath, const char *binaryPath)
+	{
+		FILE *file = fopen(textPath, "r");
+		if (!file)
+		{
+			printf("Cannot open scene %s\n", textPath);
+			return false;
+		}
+		CameraRecord camera = {{0, 4, 8}, {0, 0, 1}, {0, 1, 0}, 75};
+		std::vector<MaterialRecord> materials;
+		std::vector<LightRecord> lights;
+		std::vector<ObjectRecord> objects;
+		char line[1024], keyword[32], shader[32], texture[32], geometry[32];
+		const char *error = nullptr;
+		int lineNumber = 0;
+		while (!error && fgets(line, sizeof(line), file))
+		{
+			lineNumber++;
+			if (char *comment = strchr(line, '#'))
+				*comment = 0;
+			if (sscanf(line, "%31s", keyword) != 1)
+				continue;
+			if (strcmp(keyword, "camera") == 0)
+			{
+				CameraRecord &c = camera;
+				if (sscanf(line, "%*s %f %f %f %f %f %f %f %f %f %f", &c.eye[0], &c.eye[1], &c.eye[2], &c.lookat[0], &c.lookat[1], &c.lookat[2],
+						   &c.up[0], &c.up[1], &c.up[2], &c.fov) < 9)
+					error = "camera needs eye, lookat and up";
+			}
+			else if (strcmp(keyword, "material") == 0)
+			{
+				MaterialRecord m;
+				if (sscanf(line, "%*s %f %f %f %f %f %f %f %f %f %f", &m.kd[0], &m.kd[1], &m.kd[2], &m.ks[0], &m.ks[1], &m.ks[2],
+						   &m.ka[0], &m.ka[1], &m.ka[2], &m.shininess) != 10)
+					error = "material needs kd, ks, ka and shininess";
+				materials.push_back(m);
+			}
+			else if (strcmp(keyword, "light") == 0)
+			{
+				LightRecord l;
+				if (sscanf(line, "%*s %f %f %f %f %f %f %f %f %f %f %f", &l.La[0], &l.La[1], &l.La[2], &l.Le[0], &l.Le[1], &l.Le[2],
+						   &l.position[0], &l.position[1], &l.position[2], &l.position[3], &l.range) != 11)
+					error = "light needs La, Le, position and range";
+				lights.push_back(l);
+			}
+			else if (strcmp(keyword, "object") == 0)
+			{
+				ObjectRecord o;
+				unsigned int mirrors = 0;
+				int n = sscanf(line, "%*s %31s %31s %31s %u %f %f %f %f %f %f %f %f %f %f %u", shader, texture, geometry, &o.material,
+							   &o.translation[0], &o.translation[1], &o.translation[2], &o.scale[0], &o.scale[1], &o.scale[2],
+							   &o.axis[0], &o.axis[1], &o.axis[2], &o.angle, &mirrors);
+				int s = Lookup(shader, ShaderName, SHADERS), t = Lookup(texture, TextureName, TEXTURES), g = Lookup(geometry, GeometryName, GEOMETRIES);
+				if (n < 14)
+					error = "object needs shader, texture, geometry, material, translation, scale, axis and angle";
+				else if (s < 0 || t < 0 || g < 0)
+					error = "unknown shader, texture or geometry";
+				else if (o.material >= materials.size())
+					error = "material not defined before";
+				else if (mirrors > 15)
+					error = "mirrors is a mask of 4 bits";
+				o.shader = s;
+				o.texture = t;
+				o.geometry = g;
+				o.mirrors = mirrors;
+				objects.push_back(o);
+			}
+			else
+				error = "unknown record";
+		}
+		fclose(file);
+		if (error)
+		{
+			printf("%s:%d: %s\n", textPath, lineNumber, error);
+			return false;
+		}
+		return Write(binaryPath, camera, materials, lights, objects);
+	}
+
+	// the mapped scene as text, in the format Convert reads
+	bool WriteText(const char *path) const
+	{
+		FILE *file = fopen(path, "w");
+		if (!file)
+		{
+			printf("Cannot write scene %s\n", path);
+			return false;
+		}
+		const CameraRecord &c = header->camera;
+		fprintf(file, "camera %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g\n", c.eye[0], c.eye[1], c.eye[2],
+				c.lookat[0], c.lookat[1], c.lookat[2], c.up[0], c.up[1], c.up[2], c.fov);
+		for (unsigned int i = 0; i < header->nMaterials; i++)
+		{
+			const MaterialRecord &m = materials[i];
+			fprintf(file, "material %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g\n", m.kd[0], m.kd[1], m.kd[2],
+					m.ks[0], m.ks[1], m.ks[2], m.ka[0], m.ka[1], m.ka[2], m.shininess);
+		}
+		for (unsigned int i = 0; i < header->nLights; i++)
+		{
+			const LightRecord &l = lights[i];
+			fprintf(file, "light %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g %.9g  %.9g\n", l.La[0], l.La[1], l.La[2],
+					l.Le[0], l.Le[1], l.Le[2], l.position[0], l.position[1], l.position[2], l.position[3], l.range);
+		}
+		for (unsigned int i = 0; i < header->nObjects; i++)
+		{
+			const ObjectRecord &o = objects[i];
+			fprintf(file, "object %s %s %s %u  %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g %.9g  %u\n", ShaderName(o.shader),
+					TextureName(o.texture), GeometryName(o.geometry), o.material, o.translation[0], o.translation[1], o.translation[2],
+					o.scale[0], o.scale[1], o.scale[2], o.axis[0], o.axis[1], o.axis[2], o.angle, (unsigned int)o.mirrors);
+		}
+		bool ok = fclose(file) == 0;
+		if (!ok)
+			printf("Cannot write scene %s\n", path);
+		return ok;
+	}
+};
+
+//---------------------------
+class StaticLayer
+{ // color and depth of the objects that did not change, drawn once and copied into the frames while the signature of the
+  // camera, the objects and their lights stays the same, the dynamic objects are drawn on top
+	//---------------------------
+	unsigned int fbo = 0, colorTexture = 0, depthTexture = 0, vao = 0;
+	int width = 0, height = 0;
+	GLenum format = GL_RGBA8; // of the color, as deep as the framebuffer it is copied into
+	GPUProgram *compositeProgram = nullptr;
+	GLint framebuffer = 0;		  // bound before Begin
+	unsigned long long built = 0; // signature of the cached pixels, 0: nothing cached
+
+	void Allocate(int _width, int _height, GLenum _format)
+	{
+		FreeTargets();
+		width = _width;
+		height = _height;
+		format = _format;
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glGenTextures(1, &colorTexture);
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+		glGenTextures(1, &depthTexture);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			printf("Static layer %dx%d is incomplete\n", width, height);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	void FreeTargets()
+	{
+		if (!fbo)
+			return;
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &colorTexture);
+		glDeleteTextures(1, &depthTexture);
+		fbo = colorTexture = depthTexture = 0;
+		width = height = 0;
+		built = 0;
+	}
+
+public:
+	std::vector<unsigned char> cached; // per object of the scene, drawn from the layer
+	unsigned long long signature = 0; // of the current frame, FNV-1a of 32 bit words
+
+	void Reset() { signature = 14695981039346656037ull; }
+
+	void Add(const void *data, size_t bytes) // a multiple of 4 bytes
+	{
+		const unsigned int *words = (const unsigned int *)data;
+		for (size_t i = 0; i < bytes / 4; i++)
+			signature = (signature ^ words[i]) * 1099511628211ull;
+	}
+
+	bool Current(int _width, int _height) { return built != 0 && built == signature && width == _width && height == _height; }
+
+	// the static objects are drawn between Begin and End, the viewport is width x height at the origin of the framebuffer
+	void Begin(int _width, int _height)
+	{
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+		GLint bits = 8; // an 8 bit copy of a deeper window would round the cached pixels differently from the drawn ones
+		glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, framebuffer ? GL_COLOR_ATTACHMENT0 : GL_BACK_LEFT, GL_FRAMEBUFFER_ATTACHMENT_RED_SIZE, &bits);
+		GLenum _format = bits > 8 ? GL_RGB10_A2 : GL_RGBA8;
+		if (_width != width || _height != height || _format != format)
+			Allocate(_width, _height, _format);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, width, height);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // with the clear color of the frame
+	}
+
+	void End()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, width, height);
+		built = signature;
+	}
+
+	// color and depth into the bound framebuffer, a depth blit would need the same depth format as the window
+	void Composite()
+	{
+		if (!compositeProgram)
+		{
+			const char *vertexSource = R"(
+				#version 330
+				void main() { gl_Position = vec4(gl_VertexID == 1 ? 3 : -1, gl_VertexID == 2 ? 3 : -1, 0, 1); } // covers the viewport
+			)";
+			const char *fragmentSource = R"(
+				#version 330
+				uniform sampler2D colorLayer, depthLayer;
+				out vec4 fragmentColor;
+				void main() {
+					ivec2 p = ivec2(gl_FragCoord.xy);
+					fragmentColor = texelFetch(colorLayer, p, 0);
+					gl_FragDepth = texelFetch(depthLayer, p, 0).r;
+				}
+			)";
+			compositeProgram = new GPUProgram();
+			compositeProgram->create(vertexSource, fragmentSource, "fragmentColor");
+			glGenVertexArrays(1, &vao);
+		}
+		compositeProgram->Use();
+		compositeProgram->setUniform(0, "colorLayer");
+		compositeProgram->setUniform(4, "depthLayer"); // after the units of the light lists and the instances
+		glActiveTexture(GL_TEXTURE4);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, colorTexture);
+		glBindVertexArray(vao);
+		glDepthFunc(GL_ALWAYS); // the depth test also enables the depth writes
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glDepthFunc(GL_LESS);
+	}
+
+	void Release()
+	{
+		FreeTargets();
+		if (compositeProgram)
+		{
+			delete compositeProgram;
+			compositeProgram = nullptr;
+			glDeleteVertexArrays(1, &vao);
+			vao = 0;
+		}
+	}
+};
+
+//---------------------------
+class Scene
+{
+	//---------------------------
+	Arena arena; // owns every shader, material, texture, geometry and object of the scene
+	std::vector<Object *> objects;
+	std::vector<Ball *> balls; // also in objects
+	std::vector<Object *> bowlObjects; // targets of picking, also in objects
+	BallCollisions collisions;
+	std::vector<BallCollisions::Body> bodies;
+	Camera camera; // 3D camera
+	std::vector<Light> lights; // the lights of the scene, then the orbiting point lights
+	int sceneLights = 0;
+	std::vector<vec4> lightOrbits; // radius, height, phase, angular speed of the point lights
+	LightGrid lightGrid;
+	vec3 masterNormal, masterPosition;
+	SphereImpostors *impostors;
+	GpuBalls *gpuBalls;
+	FrustumCuller culler;
+	OcclusionCuller occlusion;
+	StaticLayer staticLayer;
+	std::vector<Light> previousLights; // of the last frame, the lights that moved since then are animated
+	std::vector<Light> layerLights;	   // of the frame the static layer was drawn in
+	std::vector<unsigned char> movingLights;
+	DrawBatches batches;
+	FrameState frame; // member, so the light list is not reallocated every frame
+	Shader *ballShader; // shared by all balls
+	Material *ballMaterial;
+	Texture *ballTexture;
+	Geometry *ballGeometry;
+	Shader *shaders[SceneFile::SHADERS] = {}; // by the kinds of the scene files, created at the first use
+	Texture *textures[SceneFile::TEXTURES] = {};
+	Geometry *geometries[SceneFile::GEOMETRIES] = {};
+
+	// without a GL context there are no shaders and textures, only the geometry on the CPU
+	Shader *SceneShader(int kind)
+	{
+		if (shaders[kind] || headless)
+			return shaders[kind];
+		switch (kind)
+		{
+		case SceneFile::SHADER_GOURAUD:
+			return shaders[kind] = arena.New<GouraudShader>();
+		case SceneFile::SHADER_BOWL:
+			return shaders[kind] = arena.New<BowlShader>();
+		case SceneFile::SHADER_PHONG:
+			return shaders[kind] = arena.New<PhongShader>();
+		default:
+			return shaders[kind] = arena.New<NPRShader>();
+		}
+	}
+
+	Texture *SceneTexture(int kind)
+	{
+		if (textures[kind] || headless)
+			return textures[kind];
+		if (kind == SceneFile::TEXTURE_CHECKER)
+			return textures[kind] = arena.New<CheckerBoardTexture>(15, 20);
+		return textures[kind] = arena.New<BowlTexure>(512, 512);
+	}
+
+	Geometry *SceneGeometry(int kind)
+	{
+		if (geometries[kind])
+			return geometries[kind];
+		if (kind == SceneFile::GEOMETRY_SPHERE)
+			return geometries[kind] = CreateSphere(arena);
+		geometries[kind] = CreateBowl(arena); // one quadrant, drawn with four mirror instances
+		if (!proceduralGeometry)
+			((ParamSurface *)geometries[kind])->BuildBVH(); // no hitch at the first click
+		return geometries[kind];
+	}
+
+	void CreateBallRenderers()
+	{
+		if (headless)
+			return;
+		impostors = arena.New<SphereImpostors>();
+		gpuBalls = arena.New<GpuBalls>();
+		gpuBalls->material.kd = vec3(0.6f, 0.4f, 0.2f);
+		gpuBalls->material.ks = vec3(4, 4, 4);
+		gpuBalls->material.ka = vec3(0.1f, 0.1f, 0.1f);
+		gpuBalls->material.shininess = 100;
+	}
+
+	// the balls of clicks roll in the bowl, the master position is where they start without a hit
+	void SetupBalls(Material *material)
+	{
+		Geometry *bowl = SceneGeometry(SceneFile::GEOMETRY_BOWL);
+		Ball::bowl = proceduralGeometry ? arena.New<Bowl>(1.0f, 1.0f) : (Bowl *)bowl; // procedural bowls have no surface on the CPU
+		ballShader = SceneShader(SceneFile::SHADER_GOURAUD);
+		ballMaterial = material;
+		ballTexture = SceneTexture(SceneFile::TEXTURE_CHECKER);
+		ballGeometry = SceneGeometry(SceneFile::GEOMETRY_SPHERE);
+
+		Bowl *buttomLeftCorner = Ball::bowl;
+		vec3 normal = buttomLeftCorner->GenVertexData(0.5, 0.5).normal;
+		normal = normal / magnitude(normal);
+		vec3 direction = (2 * height(0.5, 0.5) + 0.1 * normal);
+		masterPosition = vec3(-direction.x, -direction.y, direction.z);
+		masterNormal = normal;
+	}
+
+public:
+	// picks the bowl under the pixel, the hit position is in world and the uv in the bowl quadrant
+	bool Pick(int pX, int pY, RayHit &hit)
+	{
+		TRACE_SCOPE("Scene::Pick"); // the time of the ray query, the first one also builds the BVH
+		vec3 origin, dir;
+		camera.Ray(pX, pY, origin, dir);
+		hit.t = INFINITY;
+		hit.object = nullptr;
+		for (Object *obj : bowlObjects)
+			obj->Intersect(origin, dir, hit);
+		return hit.object != nullptr;
+	}
+
+	// spawns a ball at rest where the click hits the bowl, otherwise at the master position
+	void addSphere(int pX, int pY)
+	{
+		RayHit hit;
+		if (!Pick(pX, pY, hit))
+		{
+			addSphere((float)pX / screenWidth, (float)pY / screenHeight);
+			return;
+		}
+		ParamSurface *bowl = (ParamSurface *)hit.object->geometry;
+		ParamSurface::VertexData vtx = bowl->GenVertexData(hit.uv.x, hit.uv.y); // of the reflection that was hit
+		vec3 normal = normalize(vtx.normal * hit.mirror * (hit.mirror.x * hit.mirror.y * hit.mirror.z));
+		vec3 direction = vtx.position * hit.mirror; // Ball::Animate snaps to 2 height(direction)
+		direction.z = 0;
+		addSphere(vec3(0, 0, 0), normal, direction, 2 * height(direction.x, direction.y) + 0.1f * normal);
+	}
+
+	void addSphere(float px, float py)
+	{
+		addSphere(vec3(px, 1 - py, 0), masterNormal, masterPosition, masterPosition);
+	}
+
+	void addSphere(vec3 velocity, vec3 normal, vec3 direction, vec3 position)
+	{
+		TRACE_SCOPE("Scene::addSphere");
+		if (gpuBallPhysics)
+		{
+			gpuBalls->Add(velocity, normal, direction, position, 0.1f);
+			return;
+		}
+		Ball *sphereObject1 = arena.New<Ball>(velocity, normal, direction, ballShader, ballMaterial, ballTexture, ballGeometry);
+		printf("%f , %f \n",
+			   velocity.x,
+			   velocity.y);
+		sphereObject1->translation = position;
+		sphereObject1->scale = vec3(0.1f, 0.1f, 0.1f);
+		objects.push_back(sphereObject1);
+		balls.push_back(sphereObject1);
+	}
+
+	void Build()
+	{
+		CreateBallRenderers();
+
+		// Materials
+		Material *material0 = arena.New<Material>();
+		material0->kd = vec3(0.6f, 0.4f, 0.2f);
+		material0->ks = vec3(4, 4, 4);
+		material0->ka = vec3(0.1f, 0.1f, 0.1f);
+		material0->shininess = 100;
+
+		Material *material1 = arena.New<Material>();
+		material1->kd = vec3(0.8f, 0.6f, 0.4f);
+		material1->ks = vec3(0.3f, 0.3f, 0.3f);
+		material1->ka = vec3(0.2f, 0.2f, 0.2f);
+		material1->shininess = 30;
+
+		// Shaders, textures and geometries are created at the first use
+		SetupBalls(material0);
+		Geometry *bowl = SceneGeometry(SceneFile::GEOMETRY_BOWL);
+
+		// Create objects by setting up their vertex data on the GPU
+
+		Object *BowlObject = arena.New<Object>(SceneShader(SceneFile::SHADER_BOWL), material1, SceneTexture(SceneFile::TEXTURE_BOWL), bowl);
+		BowlObject->translation = vec3(0, 0, 0);
+		BowlObject->scale = vec3(2, 2, 2);
+		BowlObject->mirrors = {vec3(1, 1, 1), vec3(1, -1, 1), vec3(-1, 1, 1), vec3(-1, -1, 1)};
+		BowlObject->occluder = true;
+		objects.push_back(BowlObject);
+		if (!proceduralGeometry)
+		{
+			ParamSurface *surface = (ParamSurface *)bowl;
+			bowlObjects.push_back(BowlObject);
+			unsigned int nBowlVertices = surface->nVtxPerStrip * surface->nStrips;
+			printf("Bowl vertices: %u for 4 mirrored quadrants, %u bytes/vertex (uncompressed %u), %u bytes saved\n",
+				   nBowlVertices, surface->vertexSize, (unsigned int)sizeof(ParamSurface::VertexData),
+				   4 * nBowlVertices * (unsigned int)sizeof(ParamSurface::VertexData) - nBowlVertices * surface->vertexSize);
+			surface->ReportTessellation("Bowl");
+		}
+		Object *sphereObject1 = arena.New<Object>(ballShader, material0, ballTexture, ballGeometry);
+		sphereObject1->translation = masterPosition;
+		sphereObject1->scale = vec3(0.1f, 0.1f, 0.1f);
+		objects.push_back(sphereObject1);
+
+		// Camera
+		camera.wEye = vec3(0, 4, 8);
+		camera.wLookat = vec3(0, 0, 1);
+		camera.wVup = vec3(0, 1, 0);
+
+		// Lights
+		lights.resize(2);
+		sceneLights = 2;
+		lights[0].wLightPos = vec4(5, 5, 4, 0); // ideal point -> directional light source
+		lights[0].La = vec3(0.1f, 0.1f, 1);
+		lights[0].Le = vec3(3, 0, 0);
+
+		lights[1].wLightPos = vec4(-5, 5, 5, 0); // ideal point -> directional light source
+		lights[1].La = vec3(0.1f, 0.1f, 0.1f);
+		lights[1].Le = vec3(0, 0, 3);
+	}
+
+	// replaces the scene with the one of the file, the materials and the objects are contiguous tables in the arena
+	void Load(const SceneFile &file)
+	{
+		TRACE_SCOPE("Scene::Load");
+		Destroy();
+		CreateBallRenderers();
+		const SceneFile::Header &header = *file.header;
+
+		const SceneFile::CameraRecord &c = header.camera;
+		camera.wEye = vec3(c.eye[0], c.eye[1], c.eye[2]);
+		camera.wLookat = vec3(c.lookat[0], c.lookat[1], c.lookat[2]);
+		camera.wVup = vec3(c.up[0], c.up[1], c.up[2]);
+		camera.fov = c.fov * (float)M_PI / 180.0f;
+
+		lights.resize(header.nLights);
+		sceneLights = header.nLights;
+		lightOrbits.clear();
+		for (unsigned int i = 0; i < header.nLights; i++)
+		{
+			const SceneFile::LightRecord &l = file.lights[i];
+			lights[i].La = vec3(l.La[0], l.La[1], l.La[2]);
+			lights[i].Le = vec3(l.Le[0], l.Le[1], l.Le[2]);
+			lights[i].wLightPos = vec4(l.position[0], l.position[1], l.position[2], l.position[3]);
+			lights[i].range = l.range;
+		}
+
+		Material *materials = arena.NewArray<Material>(header.nMaterials);
+		for (unsigned int i = 0; i < header.nMaterials; i++)
+		{
+			const SceneFile::MaterialRecord &m = file.materials[i];
+			materials[i].kd = vec3(m.kd[0], m.kd[1], m.kd[2]);
+			materials[i].ks = vec3(m.ks[0], m.ks[1], m.ks[2]);
+			materials[i].ka = vec3(m.ka[0], m.ka[1], m.ka[2]);
+			materials[i].shininess = m.shininess;
+		}
+
+		Object *table = arena.NewArray<Object>(header.nObjects, nullptr, nullptr, nullptr, nullptr);
+		objects.resize(header.nObjects);
+		for (unsigned int i = 0; i < header.nObjects; i++)
+		{
+			const SceneFile::ObjectRecord &o = file.objects[i];
+			Object &obj = table[i];
+			obj.shader = SceneShader(o.shader);
+			obj.material = &materials[o.material];
+			obj.texture = SceneTexture(o.texture);
+			obj.geometry = SceneGeometry(o.geometry);
+			obj.translation = vec3(o.translation[0], o.translation[1], o.translation[2]);
+			obj.scale = vec3(o.scale[0], o.scale[1], o.scale[2]);
+			obj.rotationAxis = vec3(o.axis[0], o.axis[1], o.axis[2]);
+			obj.rotationAngle = o.angle;
+			for (int m = 0; m < 4; m++)
+				if (o.mirrors & (1 << m))
+					obj.mirrors.push_back(SceneFile::MirrorSigns(m));
+			objects[i] = &obj;
+			obj.occluder = o.geometry == SceneFile::GEOMETRY_BOWL;
+			if (obj.occluder && !proceduralGeometry)
+				bowlObjects.push_back(&obj);
+		}
+
+		if (header.nMaterials == 0)
+		{ // the balls of clicks need one
+			materials = arena.New<Material>();
+			materials->kd = vec3(0.6f, 0.4f, 0.2f);
+			materials->ks = vec3(4, 4, 4);
+			materials->ka = vec3(0.1f, 0.1f, 0.1f);
+			materials->shininess = 100;
+		}
+		SetupBalls(&materials[0]);
+	}
+
+	unsigned int ObjectCount() const { return objects.size(); }
+
+	static bool SameLight(const Light &l, const Light &p)
+	{
+		return l.La.x == p.La.x && l.La.y == p.La.y && l.La.z == p.La.z && l.Le.x == p.Le.x && l.Le.y == p.Le.y && l.Le.z == p.Le.z &&
+			   l.wLightPos.x == p.wLightPos.x && l.wLightPos.y == p.wLightPos.y && l.wLightPos.z == p.wLightPos.z &&
+			   l.wLightPos.w == p.wLightPos.w && l.range == p.range;
+	}
+
+	static bool Reaches(const Light &light, vec3 center, float radius)
+	{
+		const vec4 &p = light.wLightPos;
+		return p.w == 0 || light.range <= 0 || length(center - vec3(p.x, p.y, p.z) / p.w) < light.range + radius;
+	}
+
+	// the objects that are not dynamic and not reached by a light that moved since the last frame are drawn from the layer,
+	// its signature covers what their pixels depend on: the camera, the resolution, the objects and the lights that stand
+	// still; returns their count
+	// a moving light reaches the objects around its position in this frame and in the frame of the layer, so one that jumps
+	// away in a step still redraws what it lit in the layer
+	unsigned int ClassifyStatic(const FrameState &frame)
+	{
+		movingLights.assign(lights.size(), 0);
+		bool reachesAll = false; // a moving light without a range
+		for (unsigned int i = 0; i < lights.size(); i++)
+		{
+			const Light &l = lights[i];
+			if (i < previousLights.size() && SameLight(l, previousLights[i]))
+				continue;
+			movingLights[i] = 1;
+			reachesAll |= l.wLightPos.w == 0 || l.range <= 0 || (i < layerLights.size() && (layerLights[i].wLightPos.w == 0 || layerLights[i].range <= 0));
+		}
+		previousLights = lights;
+
+		staticLayer.cached.assign(objects.size(), 0);
+		staticLayer.Reset();
+		staticLayer.Add(&frame.V, sizeof(mat4));
+		staticLayer.Add(&frame.P, sizeof(mat4));
+		int settings[] = {frame.width, frame.height, lodEnabled, proceduralTessellation, frustumCulling, drawBatching};
+		staticLayer.Add(settings, sizeof(settings));
+		if (reachesAll)
+			return 0;
+		unsigned int count = 0;
+		for (unsigned int i = 0; i < objects.size(); i++)
+		{
+			Object *obj = objects[i];
+			if (obj->Dynamic() || (impostorBalls && obj->geometry->IsSphere())) // the impostors are drawn after the layer
+				continue;
+			vec3 center, lo, hi;
+			float r;
+			obj->WorldBounds(center, r, lo, hi);
+			bool reached = false;
+			for (unsigned int j = 0; j < lights.size() && !reached; j++)
+				reached = movingLights[j] && (Reaches(lights[j], center, r) || (j < layerLights.size() && Reaches(layerLights[j], center, r)));
+			if (reached)
+				continue;
+			staticLayer.cached[i] = 1;
+			count++;
+			const void *pointers[] = {obj, obj->shader, obj->material, obj->texture, obj->geometry};
+			staticLayer.Add(pointers, sizeof(pointers));
+			staticLayer.Add(obj->material, sizeof(Material));
+			staticLayer.Add(&center, sizeof(vec3)); // with the box of the transform and the mirrors
+			staticLayer.Add(&lo, sizeof(vec3));
+			staticLayer.Add(&hi, sizeof(vec3));
+			staticLayer.Add(&obj->rotationAxis, sizeof(vec3));
+			staticLayer.Add(&obj->rotationAngle, sizeof(float));
+		}
+		for (unsigned int i = 0; i < lights.size(); i++)
+			if (!movingLights[i])
+			{
+				staticLayer.Add(&lights[i].La, sizeof(vec3));
+				staticLayer.Add(&lights[i].Le, sizeof(vec3));
+				staticLayer.Add(&lights[i].wLightPos, sizeof(vec4));
+				staticLayer.Add(&lights[i].range, sizeof(float));
+			}
+		return count;
+	}
+
+	// colored point lights circling above the floor of the bowl (z = 2), in addition to the lights of the scene
+	void SetPointLights(int n)
+	{
+		lights.resize(sceneLights + n);
+		lightOrbits.resize(n);
+		for (int i = 0; i < n; i++)
+		{
+			float a = fmodf(i * 0.618034f, 1), b = fmodf(i * 0.754878f, 1), c = fmodf(i * 0.569840f, 1); // low discrepancy
+			Light &light = lights[sceneLights + i];
+			light.La = vec3(0, 0, 0);
+			light.Le = vec3(1 - a, fabsf(2 * b - 1), a) * 2;
+			light.range = 1;
+			lightOrbits[i] = vec4(0.3f + 2 * a, 2.4f + b, 2 * (float)M_PI * c, (i & 1 ? 1 : -1) * (0.3f + 0.7f * b));
+			light.wLightPos = vec4(0, 0, 0, 1);
+		}
+		AnimatePointLights(0);
+	}
+
+	void AnimatePointLights(float t)
+	{
+		for (unsigned int i = 0; i < lightOrbits.size(); i++)
+		{
+			const vec4 &orbit = lightOrbits[i];
+			float angle = orbit.z + orbit.w * t;
+			lights[sceneLights + i].wLightPos = vec4(orbit.x * cosf(angle), orbit.x * sinf(angle), orbit.y, 1);
+		}
+	}
+
+	// bulk teardown, frees the GL resources of the scene as well
+	void Destroy()
+	{
+		objects.clear();
+		balls.clear();
+		bowlObjects.clear();
+		bodies.clear();
+		impostors = nullptr;
+		gpuBalls = nullptr;
+		std::fill(shaders, shaders + SceneFile::SHADERS, nullptr);
+		std::fill(textures, textures + SceneFile::TEXTURES, nullptr);
+		std::fill(geometries, geometries + SceneFile::GEOMETRIES, nullptr);
+		arena.Clear();
+		lightGrid.Release();
+		occlusion.Release();
+		staticLayer.Release();
+		previousLights.clear();
+		layerLights.clear();
+		batches.Release();
+		for (GeometryPool &pool : geometryPools)
+			pool.Release();
+	}
+
+	// into the viewport of the bound framebuffer, width x height pixels
+	void Render(int width = screenWidth, int height = screenHeight)
+	{
+		static int renderZone = profiler.AddZone("render"), cullZone = profiler.AddZone("cull"), objectZone = profiler.AddZone("objects"),
+				   occlusionZone = profiler.AddZone("occlusion"), staticZone = profiler.AddZone("static layer"), impostorZone = profiler.AddZone("impostors"), gpuBallZone = profiler.AddZone("gpu balls");
+		ProfileScope renderScope(renderZone);
+		TRACE_SCOPE("Scene::Render");
+		frameStats.Reset();
+		camera.asp = (float)width / height;
+		frame.wEye = camera.wEye;
+		frame.width = width;
+		frame.height = height;
+		frame.V = camera.V();
+		frame.P = camera.P();
+		frame.VP = frame.V * frame.P;
+		frame.lights = lights; // reuses the capacity of the previous frame
+		{
+			TRACE_SCOPE("light grid");
+			// the tiles cover the same part of the screen at every resolution, so do the light lists
+			lightGrid.Build(lights, frame.V, frame.P, width, height, std::max(4, LightGrid::windowTileSize * height / screenHeight));
+			lightGrid.Upload();
+		}
+		frame.lightGrid = &lightGrid;
+		frameStats.lights = lights.size();
+		frameStats.maxTileLights = lightGrid.maxPerTile;
+		if (frustumCulling)
+		{
+			ProfileScope scope(cullZone);
+			culler.Cull(objects, frame.VP);
+		}
+		{
+			ProfileScope scope(objectZone, true);
+			auto submit = [&](Object *obj)
+			{
+				if (impostorBalls && impostors->Add(obj))
+					return;
+				if (!drawBatching || !batches.Add(obj, frame))
+					obj->Draw(frame);
+			};
+			bool layered = false; // the cached objects are in the frame already
+			if (staticCaching)
+			{ // on the CPU like the occlusion, the GPU zones do not nest
+				ProfileScope staticScope(staticZone);
+				layered = ClassifyStatic(frame) > 0;
+			}
+			if (layered)
+			{
+				if (!staticLayer.Current(width, height))
+				{
+					staticLayer.Begin(width, height);
+					for (unsigned int i = 0; i < objects.size(); i++)
+						if (staticLayer.cached[i] && (!frustumCulling || culler.visible[i]) && (!drawBatching || !batches.Add(objects[i], frame)))
+							objects[i]->Draw(frame);
+					batches.Draw(frame);
+					staticLayer.End();
+					layerLights = lights;
+				}
+				staticLayer.Composite();
+			}
+			if (occlusionCulling)
+			{ // the occluders first, the others are tested against their depth
+				for (unsigned int i = 0; i < objects.size(); i++)
+					if (objects[i]->occluder && (!frustumCulling || culler.visible[i]) && !(layered && staticLayer.cached[i]))
+						submit(objects[i]);
+				batches.Draw(frame);
+				ProfileScope occlusionScope(occlusionZone); // on the CPU, the GPU zones do not nest, it waits for the occluders
+				occlusion.Build(width, height, frame.V, frame.P);
+			}
+			for (unsigned int i = 0; i < objects.size(); i++)
+			{
+				Object *obj = objects[i];
+				if (frustumCulling && !culler.visible[i])
+				{
+					frameStats.culled++;
+					continue;
+				}
+				if (layered && staticLayer.cached[i])
+				{
+					frameStats.cached++;
+					continue;
+				}
+				if (occlusionCulling && (obj->occluder || occlusion.Occluded(obj)))
+				{
+					frameStats.occluded += !obj->occluder;
+					continue;
+				}
+				submit(obj);
+			}
+			batches.Draw(frame);
+		}
+		{
+			ProfileScope scope(impostorZone, true);
+			impostors->Draw(frame);
+		}
+		{
+			ProfileScope scope(gpuBallZone, true);
+			gpuBalls->Draw(frame);
+		}
+	}
+
+	// the response is applied to the velocity and the direction in the parameter domain of the balls
+	void Collide()
+	{
+		bodies.resize(balls.size());
+		for (unsigned int i = 0; i < balls.size(); i++)
+		{
+			bodies[i].position = balls[i]->translation;
+			bodies[i].velocity = balls[i]->velocity;
+		}
+		collisions.Step(bodies);
+		for (unsigned int i = 0; i < balls.size(); i++)
+		{
+			balls[i]->velocity = bodies[i].velocity;
+			balls[i]->direction = balls[i]->direction + vec3(bodies[i].push.x, bodies[i].push.y, 0) / 2; // world xy = 2 direction xy
+		}
+	}
+
+	void Animate(float tstart, float tend)
+	{
+		static int animateZone = profiler.AddZone("animate"), collideZone = profiler.AddZone("collide");
+		ProfileScope scope(animateZone);
+		for (Object *obj : objects)
+			obj->Animate(tstart, tend);
+		{
+			ProfileScope collideScope(collideZone);
+			Collide();
+		}
+		gpuBalls->Animate(tstart, tend);
+		if (!lightAnimation)
+			return;
+		for (int i = 0; i < sceneLights; i++)
+			if (lights[i].wLightPos.w == 0) // the directional lights turn
+				lights[i].Animate(tstart, tend);
+		AnimatePointLights(tend);
+	}
+
+	// the simulation changes the scene, the on demand rendering needs frames
+	bool Animating() { return lightAnimation || !balls.empty() || gpuBalls->Count() > 0; }
+};
+
+//---------------------------
+class RenderTarget
+{ // offscreen color texture and depth buffer, allocated at the window size, a reduced resolution uses a corner of it
+	//---------------------------
+	unsigned int fbo = 0, colorTexture = 0, depthBuffer = 0;
+	int allocatedWidth = 0, allocatedHeight = 0;
+
+public:
+	int width = 0, height = 0; // of the last bind
+
+	void Bind(int _width, int _height)
+	{
+		if (_width > allocatedWidth || _height > allocatedHeight)
+		{ // only grows, resolution changes of the scaling reuse the storage
+			Release();
+			allocatedWidth = _width;
+			allocatedHeight = _height;
+			glGenFramebuffers(1, &fbo);
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+			glGenTextures(1, &colorTexture);
+			glBindTexture(GL_TEXTURE_2D, colorTexture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, allocatedWidth, allocatedHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+			glGenRenderbuffers(1, &depthBuffer);
+			glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, allocatedWidth, allocatedHeight);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+				printf("Render target %dx%d is incomplete\n", allocatedWidth, allocatedHeight);
+		}
+		width = _width;
+		height = _height;
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, width, height);
 	}
-	void Animate(float tstart, float tend) override
+
+	// bilinear upscale into the window, which is bound afterwards
+	void BlitToScreen()
 	{
-		this->acceleration = gravity - dot(gravity, normal) * normal;
-		this->velocity = this->velocity + this->acceleration * 0.001f * tend;
-		this->direction = this->direction + this->velocity * 0.001f * tend;
-		// snap to the bowl
-		float signx = this->direction.x / abs(this->direction.x), signy = this->direction.y / abs(this->direction.y);
-		Bowl *referenceBowl = new Bowl(signx, signy);
-		normal = referenceBowl->GenVertexData(abs(this->direction.x), abs(this->direction.y)).normal;
-		normal = normal / magnitude(normal);
-		vec3 position = (2 * height(this->direction.x, this->direction.y) + 0.1 * normal);
-		this->translation = vec3(position.x, position.y, position.z);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, width, height, 0, 0, screenWidth, screenHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, screenWidth, screenHeight);
+	}
 
-		// printf("%f , %f , %f\n",
-		// 	   this->translation.x,
-		// 	   this->translation.y,
-		// 	   this->translation.z);
+	void Release()
+	{
+		if (!fbo)
+			return;
+		glDeleteFramebuffers(1, &fbo);
+		glDeleteTextures(1, &colorTexture);
+		glDeleteRenderbuffers(1, &depthBuffer);
+		fbo = colorTexture = depthBuffer = 0;
+		allocatedWidth = allocatedHeight = 0;
 	}
 };
 
 //---------------------------
-class Scene
-{
+class DynamicResolution
+{ // scales the render resolution so that the frame time meets the budget, the fragment cost follows the pixel count
 	//---------------------------
-	std::vector<Object *> objects;
-	Camera camera; // 3D camera
-	std::vector<Light> lights;
-	vec3 masterNormal, masterPosition;
+	typedef std::chrono::high_resolution_clock Clock;
+	Clock::time_point start;
+	int frames = 0; // since the last adjustment
 
 public:
-	void addSphere(float px, float py)
+	bool enabled = false;
+	float budget = 33.3f;			  // milliseconds per frame
+	float scale = 1;				  // of the window resolution along both axes
+	const float minScale = 0.25f;
+	const int adjustInterval = 8;	  // frames measured between adjustments
+	float frameTime = 0;			  // smoothed, milliseconds
+	float lastFrameTime = 0;		  // milliseconds, not smoothed
+
+	DynamicResolution()
+	{ // FRAME_BUDGET_MS=<milliseconds> starts with the scaling on
+		if (const char *env = getenv("FRAME_BUDGET_MS"))
+		{
+			budget = fmaxf(1, (float)atof(env));
+			enabled = true;
+		}
+	}
+
+	// the timer queries of llvmpipe return the submission time, so the frame is timed on the CPU up to the swap,
+	// which waits for the rasterization of the previous frame
+	void BeginFrame() { start = Clock::now(); }
+	void EndFrame()
 	{
-		Shader *gouraudShader = new GouraudShader();
-		Material *material0 = new Material;
-		material0->kd = vec3(0.6f, 0.4f, 0.2f);
-		material0->ks = vec3(4, 4, 4);
-		material0->ka = vec3(0.1f, 0.1f, 0.1f);
-		material0->shininess = 100;
-		Texture *sphereTexture = new CheckerBoardTexture(15, 20);
-		Geometry *sphere = new Sphere();
-		Ball *sphereObject1 = new Ball(vec3(px, 1 - py, 0), masterNormal, masterPosition, gouraudShader, material0, sphereTexture, sphere);
-		printf("%f , %f \n",
-			   px,
-			   py);
-		sphereObject1->translation = masterPosition;
-		sphereObject1->scale = vec3(0.1f, 0.1f, 0.1f);
-		objects.push_back(sphereObject1);
+		float ms = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+		lastFrameTime = ms;
+		frameTime = frameTime == 0 ? ms : 0.8f * frameTime + 0.2f * ms;
+		if (!enabled || ++frames < adjustInterval)
+			return;
+		frames = 0;
+		float ratio = budget / frameTime;
+		if (fabsf(ratio - 1) < 0.1f)
+			return; // dead band against oscillation
+		float target = scale * sqrtf(ratio);											   // pixel count proportional to the time
+		scale = fmaxf(minScale, fminf(1, fmaxf(scale * 0.8f, fminf(scale * 1.25f, target)))); // limited step
 	}
 
-	void Build()
+	// resolution of the scene for the current window size
+	int Width() { return std::max(1, (int)(screenWidth * scale + 0.5f)); }
+	int Height() { return std::max(1, (int)(screenHeight * scale + 0.5f)); }
+	bool Offscreen() { return enabled || scale < 1; }
+};
+
+void onIdle();
+
+//---------------------------
+class FrameScheduler
+{ // decides when onIdle starts a frame, paces the frames with precise sleeps, measures the CPU usage and the latency
+	//---------------------------
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point nextFrame, inputTime, swapStart, reportTime = Clock::now();
+	std::clock_t reportCpu = std::clock(); // process time of all threads
+	bool inputPending = false, suspended = false;
+	int frames = 0, latencies = 0; // since the last report
+	float latencySum = 0, latencyMax = 0;
+
+	static float Milliseconds(Clock::duration d) { return std::chrono::duration<float, std::milli>(d).count(); }
+
+	// the sleep of the OS can overshoot by a scheduler tick, the last part is spun
+	static void SleepUntil(Clock::time_point deadline)
 	{
-		// Shaders
-		Shader *phongShader = new PhongShader();
-		Shader *gouraudShader = new GouraudShader();
-		Shader *bowlShader = new BowlShader();
-		Shader *nprShader = new NPRShader();
+		const std::chrono::microseconds spin(1500);
+		if (deadline - Clock::now() > spin)
+			std::this_thread::sleep_until(deadline - spin);
+		while (Clock::now() < deadline)
+			std::this_thread::yield();
+	}
 
-		// Materials
-		Material *material0 = new Material;
-		material0->kd = vec3(0.6f, 0.4f, 0.2f);
-		material0->ks = vec3(4, 4, 4);
-		material0->ka = vec3(0.1f, 0.1f, 0.1f);
-		material0->shininess = 100;
+public:
+	enum Mode
+	{
+		CONTINUOUS, // as fast as possible, one core busy
+		PACED,		// at the target rate
+		ON_DEMAND	// at the target rate while something changes, otherwise GLUT waits for input
+	};
+	Mode mode = PACED;
+	float targetFps = 60;
+	bool dirty = true;	  // a frame is owed for a change outside the simulation
+	bool resumed = false; // after a suspension, the simulation skips the idle time
+	float swapTime = 0;	  // smoothed milliseconds in the swap, includes the wait for the retrace with vsync
+	float fps = 0, cpuUsage = 0, latency = 0, maxLatency = 0; // of the last second, cpu in percent of one core, input to present in ms
 
-		Material *material1 = new Material;
-		material1->kd = vec3(0.8f, 0.6f, 0.4f);
-		material1->ks = vec3(0.3f, 0.3f, 0.3f);
-		material1->ka = vec3(0.2f, 0.2f, 0.2f);
-		material1->shininess = 30;
+	FrameScheduler()
+	{ // TARGET_FPS=<rate> overrides the target
+		if (const char *env = getenv("TARGET_FPS"))
+			targetFps = fmaxf(1, (float)atof(env));
+	}
 
-		// Textures
-		Texture *sphereTexture = new CheckerBoardTexture(15, 20);
-		Texture *bowlTexure = new BowlTexure(512, 512);
+	const char *ModeName() { return mode == CONTINUOUS ? "continuous" : mode == PACED ? "paced" : "on demand"; }
 
-		// Geometries
-		Geometry *sphere = new Sphere();
-		std::vector<Geometry *> bowls;
+	float Period() { return 1000 / targetFps; }
 
-		//bowl = new Bowl(1.0f,1.0f);
-		bowls.push_back(new Bowl(1.0f, 1.0f));
-		bowls.push_back(new Bowl(1.0f, -1.0f));
-		bowls.push_back(new Bowl(-1.0f, 1.0f));
-		bowls.push_back(new Bowl(-1.0f, -1.0f));
+	// changes outside the simulation: window, settings
+	void Invalidate()
+	{
+		dirty = true;
+		if (suspended)
+		{
+			suspended = false;
+			resumed = true;
+			glutIdleFunc(onIdle);
+		}
+	}
 
-		// Create objects by setting up their vertex data on the GPU
+	// the latency is measured from the first input event to the end of the swap of the next frame
+	void Input()
+	{
+		if (!inputPending)
+		{
+			inputPending = true;
+			inputTime = Clock::now();
+		}
+		Invalidate();
+	}
 
-		for (int i = 0; i < 4; i++)
+	// called at the start of onIdle, false: no frame is needed, GLUT sleeps until the next event
+	bool WaitForFrame(bool animating)
+	{
+		if (mode == ON_DEMAND && !animating && !dirty)
 		{
-			Object *BowlObject = new Object(bowlShader, material1, bowlTexure, bowls.at(i));
-			BowlObject->translation = vec3(0, 0, 0);
-			BowlObject->scale = vec3(2, 2, 2);
-			objects.push_back(BowlObject);
+			suspended = true;
+			glutIdleFunc(NULL);
+			return false;
 		}
-		Bowl *buttomLeftCorner = new Bowl(1.0f, 1.0f);
-		vec3 normal = buttomLeftCorner->GenVertexData(0.5, 0.5).normal;
-		normal = normal / magnitude(normal);
-		vec3 direction = (2 * height(0.5, 0.5) + 0.1 * normal);
-		Object *sphereObject1 = new Object(gouraudShader, material0, sphereTexture, sphere);
-		masterPosition = vec3(-direction.x, -direction.y, direction.z);
-		sphereObject1->translation = masterPosition;
-		masterNormal = normal;
-		
-		sphereObject1->scale = vec3(0.1f, 0.1f, 0.1f);
-		objects.push_back(sphereObject1);
+		if (mode != CONTINUOUS)
+		{ // a frame made late by the swap is not delayed further, so with vsync at or below the target rate the retrace paces
+			Clock::duration period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float, std::milli>(Period()));
+			Clock::time_point now = Clock::now();
+			if (nextFrame < now - period)
+				nextFrame = now; // fell behind, no burst of frames to catch up
+			SleepUntil(nextFrame);
+			nextFrame += period;
+		}
+		dirty = false;
+		return true;
+	}
 
-		int nObjects = objects.size();
+	void BeginSwap() { swapStart = Clock::now(); }
+	void EndSwap()
+	{
+		Clock::time_point now = Clock::now();
+		swapTime = 0.9f * swapTime + 0.1f * Milliseconds(now - swapStart);
+		frames++;
+		if (inputPending)
+		{
+			float ms = Milliseconds(now - inputTime);
+			latencySum += ms;
+			latencyMax = fmaxf(latencyMax, ms);
+			latencies++;
+			inputPending = false;
+		}
+		float seconds = Milliseconds(now - reportTime) / 1000;
+		if (seconds < 1)
+			return;
+		std::clock_t cpu = std::clock();
+		fps = frames / seconds;
+		cpuUsage = 100.0f * (cpu - reportCpu) / CLOCKS_PER_SEC / seconds;
+		latency = latencies ? latencySum / latencies : 0;
+		maxLatency = latencyMax;
+		reportTime = now;
+		reportCpu = cpu;
+		frames = latencies = 0;
+		latencySum = latencyMax = 0;
+	}
+};
 
-		// Camera
-		camera.wEye = vec3(0, 4, 8);
-		camera.wLookat = vec3(0, 0, 1);
-		camera.wVup = vec3(0, 1, 0);
+//---------------------------
+class OcclusionComparison
+{ // net frame time of the occlusion culling: it is switched in runs of frames, the first frames of a run are not counted
+  // because the swap waits for the rasterization of the previous frame
+	//---------------------------
+	static const int runLength = 8, settleFrames = 2;
+	int frame = 0, frames = 0;
+	bool wasEnabled = false;
+	FrameScheduler::Mode wasMode = FrameScheduler::CONTINUOUS;
+	double time[2] = {}; // milliseconds without and with the culling
+	int count[2] = {};
+	double occluded = 0;
 
-		// Lights
-		lights.resize(2);
-		lights[0].wLightPos = vec4(5, 5, 4, 0); // ideal point -> directional light source
-		lights[0].La = vec3(0.1f, 0.1f, 1);
-		lights[0].Le = vec3(3, 0, 0);
+public:
+	bool running = false;
 
-		lights[1].wLightPos = vec4(-5, 5, 5, 0); // ideal point -> directional light source
-		lights[1].La = vec3(0.1f, 0.1f, 0.1f);
-		lights[1].Le = vec3(0, 0, 3);
+	// the frames are rendered continuously meanwhile
+	void Start(FrameScheduler &scheduler, int _frames = 20 * runLength)
+	{
+		frame = 0;
+		frames = _frames;
+		time[0] = time[1] = occluded = 0;
+		count[0] = count[1] = 0;
+		wasEnabled = occlusionCulling;
+		wasMode = scheduler.mode;
+		scheduler.mode = FrameScheduler::CONTINUOUS;
+		occlusionCulling = false;
+		running = true;
+		printf("occlusion culling: comparing %d frames\n", frames);
 	}
 
-	void Render()
+	// ms: time of the frame just rendered
+	void EndFrame(float ms, FrameScheduler &scheduler)
 	{
-		RenderState state;
-		state.wEye = camera.wEye;
-		state.V = camera.V();
-		state.P = camera.P();
-		state.lights = lights;
-		for (Object *obj : objects)
-			obj->Draw(state);
+		if (!running)
+			return;
+		if (frame % runLength >= settleFrames)
+		{
+			time[occlusionCulling] += ms;
+			count[occlusionCulling]++;
+			if (occlusionCulling)
+				occluded += frameStats.occluded;
+		}
+		if (++frame % runLength == 0)
+			occlusionCulling = !occlusionCulling;
+		if (frame < frames)
+			return;
+		running = false;
+		occlusionCulling = wasEnabled;
+		scheduler.mode = wasMode;
+		double without = time[0] / std::max(1, count[0]), with = time[1] / std::max(1, count[1]);
+		printf("occlusion culling: %.2f ms/frame with, %.2f ms without, net %+.2f ms (%+.1f%%), %.0f objects occluded per frame\n",
+			   with, without, with - without, without > 0 ? (with / without - 1) * 100 : 0.0, occluded / std::max(1, count[1]));
 	}
+};
 
-	void Animate(float tstart, float tend)
+//---------------------------
+class FrameCapture
+{ // reads the frames back through a ring of pixel buffers with fences, a worker thread writes or compares them
+	//---------------------------
+public:
+	enum Format
 	{
-		for (Object *obj : objects)
-			obj->Animate(tstart, tend);
-		for (int i = 0; i < 2; i++)
-			lights.at(i).Animate(tstart, tend);
+		RAW, // rgb bytes, top row first
+		PPM,
+		PNG // stored deflate blocks, no compression
+	};
+
+private:
+	struct Slot
+	{ // glReadPixels into the buffer returns at once, the fence tells when the copy has finished
+		unsigned int pbo = 0;
+		size_t size = 0;
+		GLsync fence = 0;
+		int width = 0, height = 0, index = 0;
+	};
+	struct Frame
+	{
+		std::vector<unsigned char> pixels; // rgba, bottom row first as read
+		std::vector<unsigned char> rgb;	   // top row first
+		int width = 0, height = 0, index = 0;
+	};
+	static const int ringSize = 3; // frames in flight, the oldest is normally done when the newest is read
+	Slot ring[ringSize];
+	int head = 0, pending = 0; // next slot to read into, slots waiting for their fence
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<Frame *> queue, spare; // frames for the worker, frames to reuse
+	bool stopping = false;
+	std::vector<unsigned char> encoded; // png stream of the worker
+
+	std::string prefix;
+	Format format = PPM;
+	bool compare = false; // against the golden images at prefix instead of writing
+
+	// maps the finished buffer of the oldest slot and hands a copy to the worker
+	void Retire()
+	{
+		Slot &slot = ring[(head - pending + ringSize) % ringSize];
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		pending--;
+		Frame *frame;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (spare.empty())
+				spare.push_back(new Frame);
+			frame = spare.back();
+			spare.pop_back();
+		}
+		frame->width = slot.width;
+		frame->height = slot.height;
+		frame->index = slot.index;
+		frame->pixels.resize((size_t)slot.width * slot.height * 4);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		if (void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame->pixels.size(), GL_MAP_READ_BIT))
+		{
+			memcpy(&frame->pixels[0], data, frame->pixels.size());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(frame);
+		}
+		wake.notify_one();
+	}
+
+	void Work()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			wake.wait(lock, [this]() { return !queue.empty() || stopping; });
+			if (queue.empty())
+				return; // stopped and drained
+			Frame *frame = queue.front();
+			queue.erase(queue.begin());
+			lock.unlock();
+			Consume(*frame);
+			lock.lock();
+			spare.push_back(frame);
+		}
+	}
+
+	void Consume(Frame &frame)
+	{
+		int w = frame.width, h = frame.height;
+		frame.rgb.resize((size_t)w * h * 3);
+		for (int y = 0; y < h; y++)
+		{ // flip to top row first, drop alpha
+			const unsigned char *src = &frame.pixels[(size_t)(h - 1 - y) * w * 4];
+			unsigned char *dst = &frame.rgb[(size_t)y * w * 3];
+			for (int x = 0; x < w; x++, src += 4, dst += 3)
+			{
+				dst[0] = src[0];
+				dst[1] = src[1];
+				dst[2] = src[2];
+			}
+		}
+		char fileName[512];
+		snprintf(fileName, sizeof(fileName), "%s_%05d.%s", prefix.c_str(), frame.index, compare ? "ppm" : format == RAW ? "rgb" : format == PPM ? "ppm" : "png");
+		if (compare)
+		{
+			Compare(fileName, frame);
+			return;
+		}
+		FILE *file = fopen(fileName, "wb");
+		if (!file)
+		{
+			printf("Cannot write %s\n", fileName);
+			return;
+		}
+		if (format == PNG)
+		{
+			EncodePng(frame.rgb, w, h);
+			fwrite(&encoded[0], 1, encoded.size(), file);
+		}
+		else
+		{
+			if (format == PPM)
+				fprintf(file, "P6\n%d %d\n255\n", w, h);
+			fwrite(&frame.rgb[0], 1, frame.rgb.size(), file);
+		}
+		fclose(file);
+	}
+
+	// a pixel differs when a channel is off by more than the tolerance, the frame fails above the fraction of such pixels
+	void Compare(const char *fileName, const Frame &frame)
+	{
+		const int tolerance = 8;
+		const float maxDifferent = 0.001f;
+		FILE *file = fopen(fileName, "rb");
+		int width = 0, height = 0, maxValue = 0;
+		bool ok = file && fscanf(file, "P6 %d %d %d", &width, &height, &maxValue) == 3 && fgetc(file) != EOF && maxValue == 255;
+		std::vector<unsigned char> golden((size_t)width * height * 3);
+		ok = ok && width == frame.width && height == frame.height && fread(&golden[0], 1, golden.size(), file) == golden.size();
+		if (file)
+			fclose(file);
+		if (!ok)
+		{
+			printf("golden %s: missing or of another size than %dx%d\n", fileName, frame.width, frame.height);
+			failures++;
+			return;
+		}
+		int different = 0, maxDifference = 0;
+		for (size_t i = 0; i < golden.size(); i += 3)
+		{
+			int difference = 0;
+			for (int c = 0; c < 3; c++)
+				difference = std::max(difference, abs(golden[i + c] - frame.rgb[i + c]));
+			maxDifference = std::max(maxDifference, difference);
+			different += difference > tolerance;
+		}
+		bool passed = different <= maxDifferent * width * height;
+		printf("golden %s: %s, %d pixels differ, at most by %d\n", fileName, passed ? "passed" : "FAILED", different, maxDifference);
+		failures += !passed;
+	}
+
+	static unsigned int Crc(const unsigned char *data, size_t n, unsigned int crc = 0xffffffff)
+	{
+		static unsigned int table[256];
+		if (!table[1])
+			for (unsigned int i = 0; i < 256; i++)
+			{
+				unsigned int c = i;
+				for (int k = 0; k < 8; k++)
+					c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+				table[i] = c;
+			}
+		for (size_t i = 0; i < n; i++)
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return crc;
+	}
+
+	void EncodePng(const std::vector<unsigned char> &rgb, int width, int height)
+	{
+		auto put32 = [this](unsigned int value)
+		{
+			for (int shift = 24; shift >= 0; shift -= 8)
+				encoded.push_back((value >> shift) & 0xff);
+		};
+		auto chunk = [this, &put32](const char *type, size_t start)
+		{ // the chunk data is already appended after the place of its header
+			size_t length = encoded.size() - start;
+			unsigned char header[8] = {(unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length,
+									   (unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3]};
+			encoded.insert(encoded.begin() + start, header, header + 8);
+			put32(Crc(&encoded[start + 4], length + 4) ^ 0xffffffff);
+		};
+		static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+		encoded.assign(signature, signature + 8);
+
+		size_t start = encoded.size();
+		put32(width);
+		put32(height);
+		const unsigned char ihdr[5] = {8, 2, 0, 0, 0}; // 8 bit rgb
+		encoded.insert(encoded.end(), ihdr, ihdr + 5);
+		chunk("IHDR", start);
+
+		start = encoded.size();
+		encoded.push_back(0x78); // zlib header
+		encoded.push_back(0x01);
+		size_t rowSize = (size_t)width * 3 + 1, total = rowSize * height, done = 0; // filter byte 0 before each row
+		unsigned int a = 1, b = 0;												   // adler32
+		while (done < total)
+		{
+			size_t n = std::min<size_t>(65535, total - done);
+			encoded.push_back(done + n == total); // final block flag, stored
+			encoded.push_back(n & 0xff);
+			encoded.push_back(n >> 8);
+			encoded.push_back(~n & 0xff);
+			encoded.push_back((~n >> 8) & 0xff);
+			for (size_t end = done + n; done < end; done++)
+			{
+				size_t x = done % rowSize;
+				unsigned char byte = x == 0 ? 0 : rgb[done / rowSize * (rowSize - 1) + x - 1];
+				encoded.push_back(byte);
+				a = (a + byte) % 65521;
+				b = (b + a) % 65521;
+			}
+		}
+		put32(b << 16 | a);
+		chunk("IDAT", start);
+
+		chunk("IEND", encoded.size());
+	}
+
+public:
+	bool recording = false;
+	int frames = 0;		 // read back since the start
+	int stalls = 0;		 // frames that waited for the GPU because the ring was full
+	int failures = 0;	 // of the golden comparisons
+	float readTime = 0;	 // smoothed milliseconds of the capture in the frame loop, llvmpipe reads on the CPU and waits for the rendering
+
+	// frames go to <prefix>_<frame>.<format>, or are compared with <prefix>_<frame>.ppm
+	void Start(const std::string &_prefix, Format _format, bool _compare = false)
+	{
+		if (recording)
+			Stop();
+		prefix = _prefix;
+		format = _format;
+		compare = _compare;
+		frames = stalls = failures = 0;
+		stopping = false;
+		recording = true;
+		worker = std::thread([this]() { Work(); });
+	}
+
+	// after the scene is in the back buffer of the window, before the swap
+	void Capture(int width, int height)
+	{
+		if (!recording)
+			return;
+		auto start = std::chrono::high_resolution_clock::now();
+		while (pending > 0)
+		{ // everything finished is collected, without waiting
+			GLsync fence = ring[(head - pending + ringSize) % ringSize].fence;
+			if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				break;
+			Retire();
+		}
+		if (pending == ringSize)
+		{ // the GPU is more than the ring behind
+			glClientWaitSync(ring[head].fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			Retire();
+			stalls++;
+		}
+		Slot &slot = ring[head];
+		size_t size = (size_t)width * height * 4;
+		if (!slot.pbo)
+			glGenBuffers(1, &slot.pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		if (slot.size != size)
+		{
+			glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+			slot.size = size;
+		}
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0); // into the buffer, returns at once
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush(); // the fence must reach the GPU, or the polling never sees it signaled
+		slot.width = width;
+		slot.height = height;
+		slot.index = frames++;
+		head = (head + 1) % ringSize;
+		pending++;
+		float ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		readTime = frames == 1 ? ms : 0.9f * readTime + 0.1f * ms;
+	}
+
+	// waits for the frames in flight and for the worker, releases the buffers
+	void Stop()
+	{
+		if (!recording)
+			return;
+		while (pending > 0)
+		{
+			glClientWaitSync(ring[(head - pending + ringSize) % ringSize].fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			Retire();
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_one();
+		worker.join();
+		recording = false;
+		for (Slot &slot : ring)
+		{
+			if (slot.pbo)
+				glDeleteBuffers(1, &slot.pbo);
+			slot = Slot();
+		}
+		head = 0;
+		for (Frame *frame : spare)
+			delete frame;
+		spare.clear();
+		if (compare)
+			printf("golden %s: %d of %d frames failed\n", prefix.c_str(), failures, frames);
+		else
+			printf("Captured %d frames to %s_*, %d stalls, %.2f ms per frame in the frame loop\n", frames, prefix.c_str(), stalls, readTime);
+	}
+
+	~FrameCapture()
+	{
+		if (worker.joinable())
+		{ // the GL context may be gone at exit, only the worker is finished
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_one();
+			worker.join();
+		}
+		for (Frame *frame : spare)
+			delete frame;
+	}
+
+	static Format ParseFormat(const char *name)
+	{
+		std::string s = name ? name : "";
+		return s == "raw" ? RAW : s == "png" ? PNG : PPM;
 	}
 };
 
 Scene scene;
+RenderTarget sceneTarget;
+DynamicResolution dynamicResolution;
+FrameScheduler scheduler;
+FrameCapture frameCapture;
+OcclusionComparison occlusionComparison;
+bool printStats = false; // frame statistics on the console
+int goldenFrames = 0;	 // compared with the golden images before the program exits
+int exitFrames = 0;		 // FRAMES=<n>: the program exits after n frames, for the checks of check.sh
+int maxRenderAllocations = -1; // MAX_RENDER_ALLOCATIONS=<n> with ALLOCATION_COUNTING: exit with 1 when a frame after the first allocates more
+float fixedTimestep = 0; // simulated seconds per frame for reproducible frames, 0: real time
+
+// Window size changed, the scene follows at its resolution scale
+void onReshape(int width, int height)
+{
+	screenWidth = std::max(1, width);
+	screenHeight = std::max(1, height);
+	glViewport(0, 0, screenWidth, screenHeight);
+	scheduler.Invalidate();
+}
+
+// While the context is still current, before the window is destroyed or the program exits: releases the GL objects
+// of the globals, so their destructors at exit make no GL calls
+void onShutdown()
+{
+	static bool done = false;
+	if (done)
+		return;
+	done = true;
+	frameCapture.Stop();
+	scene.Destroy();
+	sceneTarget.Release();
+	profiler.Release();
+#if defined(GL_ACCOUNTING)
+	glAccounting().Shutdown(); // everything the program created is released by now
+#endif
+}
+
+// CHECK_BALLS=1: one ball at rest on the y axis of the bowl is stepped by Ball::Animate and by the transform feedback of
+// GpuBalls, the two paths must end at the same place
+bool CheckGpuBalls()
+{
+	vec3 direction(0, 0.5f, 0), normal = Ball::bowl->GenVertexData(0, 0.5f).normal;
+	normal = normal / magnitude(normal);
+	Ball ball(vec3(0, 0, 0), normal, direction, nullptr, nullptr, nullptr, nullptr);
+	GpuBalls gpuBalls;
+	gpuBalls.Add(vec3(0, 0, 0), normal, direction, vec3(0, 0, 0), 0.1f);
+	for (int step = 0; step < 100; step++)
+	{
+		ball.Animate(step * 0.01f, (step + 1) * 0.01f);
+		gpuBalls.Animate(step * 0.01f, (step + 1) * 0.01f);
+	}
+	vec3 position, gpuDirection;
+	gpuBalls.Read(0, position, gpuDirection);
+	float error = fmaxf(length(position - ball.translation), length(gpuDirection - ball.direction));
+	bool ok = error < 1e-3f; // false for NaN
+	printf("GPU ball at (%f, %f, %f), CPU ball at (%f, %f, %f): %s\n", position.x, position.y, position.z,
+		   ball.translation.x, ball.translation.y, ball.translation.z, ok ? "match" : "differ");
+	return ok;
+}
 
 // Initialization, create an OpenGL context
 void onInitialization()
 {
 	glViewport(0, 0, windowWidth, windowHeight);
+	glutReshapeFunc(onReshape);
+#if !defined(__APPLE__)
+	glutCloseFunc(onShutdown); // freeglut calls it for the window before it destroys the context, also when it exits
+#endif
 	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
-	scene.Build();
+	glDisable(GL_CULL_FACE); // mirrored instances have reversed winding, the shaders face the normals to the viewer
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(ParamSurface::restartIndex);
+	SceneFile sceneFile;
+	const char *scenePath = getenv("SCENE"); // SCENE=<file>: binary or text scene instead of the built in one
+	if (scenePath && sceneFile.Open(scenePath))
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		scene.Load(sceneFile);
+		printf("scene %s: %u objects, %u materials, %u lights loaded in %.1f ms\n", scenePath, sceneFile.header->nObjects,
+			   sceneFile.header->nMaterials, sceneFile.header->nLights,
+			   std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+	}
+	else
+		scene.Build();
+
+	if (const char *golden = getenv("GOLDEN"))
+	{ // GOLDEN=<prefix>: the first GOLDEN_FRAMES (1) frames are compared with <prefix>_<frame>.ppm, GOLDEN_UPDATE=1 writes them
+		const char *n = getenv("GOLDEN_FRAMES");
+		goldenFrames = std::max(1, n ? atoi(n) : 1);
+		fixedTimestep = 0.1f;
+		dynamicResolution.enabled = false;
+		scheduler.mode = FrameScheduler::CONTINUOUS;
+		frameCapture.Start(golden, FrameCapture::PPM, getenv("GOLDEN_UPDATE") == NULL);
+	}
+	else if (const char *prefix = getenv("CAPTURE")) // CAPTURE=<prefix>: records from the start
+		frameCapture.Start(prefix, FrameCapture::ParseFormat(getenv("CAPTURE_FORMAT")));
+	if (const char *n = getenv("FRAMES"))
+	{
+		exitFrames = std::max(1, atoi(n));
+		scheduler.mode = FrameScheduler::CONTINUOUS;
+	}
+	if (const char *n = getenv("MAX_RENDER_ALLOCATIONS"))
+		maxRenderAllocations = atoi(n);
+	if (getenv("CHECK_BALLS"))
+	{
+		bool ok = CheckGpuBalls();
+		onShutdown();
+		exit(ok ? 0 : 1);
+	}
 }
 
 // Window has become invalid: Redraw
 void onDisplay()
 {
+	dynamicResolution.BeginFrame();
+	bool offscreen = dynamicResolution.Offscreen();
+	int width = screenWidth, height = screenHeight;
+	if (offscreen)
+	{
+		width = dynamicResolution.Width();
+		height = dynamicResolution.Height();
+		sceneTarget.Bind(width, height);
+	}
 	glClearColor(0.5f, 0.5f, 0.8f, 1.0f);				// background color
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
-	scene.Render();
+	{
+		TRACE_SCOPE("frame");
+#if defined(ALLOCATION_COUNTING)
+		unsigned long long allocations = allocationCount;
+		scene.Render(width, height);
+		frameStats.allocations = allocationCount - allocations;
+#else
+		scene.Render(width, height);
+#endif
+	}
+	if (offscreen)
+		sceneTarget.BlitToScreen();
+	frameCapture.Capture(screenWidth, screenHeight); // without the overlay
+	if (profiler.enabled)
+	{
+		profiler.DrawOverlay();
+		profiler.EndFrame();
+	}
+	scheduler.BeginSwap();
 	glutSwapBuffers(); // exchange the two buffers
+	scheduler.EndSwap();
+	dynamicResolution.EndFrame();
+	occlusionComparison.EndFrame(dynamicResolution.lastFrameTime, scheduler);
+#if defined(GL_ACCOUNTING)
+	glAccounting().EndFrame();
+#endif
+	if (goldenFrames && frameCapture.frames >= goldenFrames)
+	{
+		onShutdown();
+		exit(frameCapture.failures ? 1 : 0);
+	}
+#if defined(ALLOCATION_COUNTING)
+	static bool warm = false; // the first frame creates the shaders and grows the per frame vectors
+	if (warm && maxRenderAllocations >= 0 && frameStats.allocations > (unsigned int)maxRenderAllocations)
+	{
+		printf("Scene::Render allocated %u times, the limit is %d\n", frameStats.allocations, maxRenderAllocations);
+		onShutdown();
+		exit(1);
+	}
+	warm = true;
+#endif
+	static int frames = 0;
+	if (exitFrames && ++frames >= exitFrames)
+	{
+		onShutdown();
+		exit(0);
+	}
+
+	static int lastPrint = 0;
+	int time = glutGet(GLUT_ELAPSED_TIME);
+	if (printStats && time - lastPrint >= 1000)
+	{
+		printf("objects: %u, culled: %u, occluded: %u, cached: %u, draw calls: %u, triangles: %u (without LOD %u), allocations: %u, lights: %u (at most %u per tile), "
+			   "resolution: %dx%d, frame: %.1f ms, %s: %.1f fps, cpu %.0f%%, swap %.1f ms, input latency %.1f ms (max %.1f)\n",
+			   frameStats.objects, frameStats.culled, frameStats.occluded, frameStats.cached, frameStats.drawCalls, frameStats.triangles, frameStats.fullTriangles, frameStats.allocations,
+			   frameStats.lights, frameStats.maxTileLights, width, height, dynamicResolution.frameTime,
+			   scheduler.ModeName(), scheduler.fps, scheduler.cpuUsage, scheduler.swapTime, scheduler.latency, scheduler.maxLatency);
+		lastPrint = time;
+	}
 }
 
 // Key of ASCII code pressed
 void onKeyboard(unsigned char key, int pX, int pY)
 {
+	scheduler.Input();
+	switch (key)
+	{
+	case 's': // print the frame statistics every second
+		printStats = !printStats;
+		break;
+	case 'l': // toggle level of detail
+		lodEnabled = !lodEnabled;
+		break;
+	case 'i': // toggle sphere impostors
+		impostorBalls = !impostorBalls;
+		break;
+	case 'g': // new balls are simulated on the GPU
+		gpuBallPhysics = !gpuBallPhysics;
+		break;
+	case 't': // start or stop recording a trace, open the file in Perfetto or chrome://tracing
+		if (tracer.recording)
+			tracer.Stop("trace.json");
+		else
+			tracer.Start();
+		break;
+#if defined(GL_ACCOUNTING)
+	case 'r': // GL calls of the last frame and live GL objects
+		glAccounting().Report();
+		break;
+#endif
+	case 'p': // profiler overlay
+		profiler.enabled = !profiler.enabled;
+		break;
+	case 'f': // toggle view frustum culling
+		frustumCulling = !frustumCulling;
+		break;
+	case 'h': // toggle occlusion culling against the depth pyramid of the bowls
+		occlusionCulling = !occlusionCulling;
+		break;
+	case 'k': // draw the unchanged objects once into a cached layer
+		staticCaching = !staticCaching;
+		break;
+	case 'H': // frame time with and without occlusion culling
+		if (!occlusionComparison.running)
+			occlusionComparison.Start(scheduler);
+		break;
+	case 'c': // record the frames to capture_<frame>.<CAPTURE_FORMAT>: ppm, png or raw
+		if (frameCapture.recording)
+			frameCapture.Stop();
+		else
+			frameCapture.Start("capture", FrameCapture::ParseFormat(getenv("CAPTURE_FORMAT")));
+		break;
+	case 'm': // draw objects differing only in their transform with one instanced call
+		drawBatching = !drawBatching;
+		break;
+	case 'v': // frame scheduling: continuous, paced to TARGET_FPS (60), on demand
+		scheduler.mode = (FrameScheduler::Mode)((scheduler.mode + 1) % 3);
+		printf("frame scheduling: %s\n", scheduler.ModeName());
+		break;
+	case 'a': // orbiting lights, a still scene needs no frames in the on demand mode
+		lightAnimation = !lightAnimation;
+		break;
+	case 'd': // dynamic resolution, scales the rendering to the frame budget
+		dynamicResolution.enabled = !dynamicResolution.enabled;
+		break;
+	case '[': // frame budget of the dynamic resolution
+		dynamicResolution.budget = fmaxf(5, dynamicResolution.budget - 5);
+		printf("frame budget: %.1f ms\n", dynamicResolution.budget);
+		break;
+	case ']':
+		dynamicResolution.budget += 5;
+		printf("frame budget: %.1f ms\n", dynamicResolution.budget);
+		break;
+	case ',': // fixed resolution scale, overridden while the dynamic resolution is on
+		dynamicResolution.scale = fmaxf(dynamicResolution.minScale, dynamicResolution.scale - 0.125f);
+		break;
+	case '.':
+		dynamicResolution.scale = fminf(1, dynamicResolution.scale + 0.125f);
+		break;
+	case 'o': // number of orbiting point lights: 0, 6, 62, 254
+	{
+		static int level = 0;
+		static const int pointLights[] = {0, 6, 62, 254}; // 2, 8, 64 and 256 lights with the directional ones
+		level = (level + 1) % 4;
+		scene.SetPointLights(pointLights[level]);
+		break;
+	}
+	case '+': // resolution of the procedural surfaces
+		proceduralTessellation++;
+		break;
+	case '-':
+		if (proceduralTessellation > 1)
+			proceduralTessellation--;
+		break;
+	}
 }
 
 // Key of ASCII code released
@@ -916,8 +5782,9 @@ void onKeyboardUp(unsigned char key, int pX, int pY)
 // Mouse click event
 void onMouse(int button, int state, int pX, int pY)
 {
+	scheduler.Input();
 	if (state)
-		scene.addSphere((float)pX / windowWidth, (float)pY / windowHeight);
+		scene.addSphere(pX, pY);
 	glutPostRedisplay();
 }
 
@@ -931,12 +5798,20 @@ void onIdle()
 {
 	static float tend = 0;
 	const float dt = 0.1f; // dt is ”infinitesimal”
+	if (!scheduler.WaitForFrame(scene.Animating()))
+		return;
 	float tstart = tend;
-	tend = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
+	tend = fixedTimestep > 0 ? tend + fixedTimestep : glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
+	if (scheduler.resumed)
+	{ // the scene stood still while suspended
+		tstart = tend;
+		scheduler.resumed = false;
+	}
 
 	for (float t = tstart; t < tend; t += dt)
 	{
 		float Dt = fmin(dt, tend - t);
+		TRACE_SCOPE("substep");
 		scene.Animate(t, t + Dt);
 	}
 	glutPostRedisplay();
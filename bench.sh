@@ -0,0 +1,4 @@
+#! /bin/bash
+
+# usage: bench.sh [filter] [--save baseline.txt] [--compare baseline.txt] | bench.sh --check
+g++ -O2 bench/bench.cpp -o bench.out -lglut -lGLEW -lGL -lGLU && ./bench.out "$@"
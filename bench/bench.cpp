@@ -0,0 +1,435 @@
+//=============================================================================================
+// Micro-benchmarks of the CPU hot paths: math, dual numbers, surface evaluation, tessellation,
+// light culling, ball collisions, BMP decoding and scene loading. Needs no GL context, build and run
+// with bench.sh.
+//
+// bench [filter] [--save file] [--compare file] | bench --check
+//   filter     runs the benchmarks whose name contains it
+//   --save     writes the medians as a baseline
+//   --compare  reports the change against a baseline, exits with 1 on a regression
+//   --check    verifies the bookkeeping of the geometry pool instead, exits with 1 on a failure
+//=============================================================================================
+#include "../Skeleton.cpp"
+#include <map>
+
+volatile float benchSink; // results are written here so the compiler cannot drop the work
+
+void Consume(float f) { benchSink = f; }
+void Consume(const vec3 &v) { benchSink = v.x + v.y + v.z; }
+void Consume(const vec4 &v) { benchSink = v.x + v.y + v.z + v.w; }
+void Consume(const mat4 &m) { benchSink = m[0][0] + m[1][1] + m[2][2] + m[3][3]; }
+void Consume(const Dnum2 &d) { benchSink = d.f + d.d.x + d.d.y; }
+
+//---------------------------
+struct BenchResult
+{
+	//---------------------------
+	std::string name;
+	double median, spread; // nanoseconds per operation, median absolute deviation in percent
+	double opsPerSecond;
+};
+
+//---------------------------
+class Bench
+{ // calibrates the repetitions to a sample duration, then takes the median of the samples
+	//---------------------------
+	typedef std::chrono::high_resolution_clock Clock;
+	const double sampleTime = 0.02; // seconds
+	const int nSamples = 21;
+	std::string filter;
+
+	template <class F>
+	double Seconds(F &body, long long reps)
+	{
+		auto start = Clock::now();
+		for (long long i = 0; i < reps; i++)
+			body();
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	static double Median(std::vector<double> v)
+	{
+		std::sort(v.begin(), v.end());
+		return v[v.size() / 2];
+	}
+
+public:
+	std::vector<BenchResult> results;
+
+	Bench(const std::string &_filter) : filter(_filter) {}
+
+	// opsPerCall: operations done by one call of body, e.g. vertices generated
+	template <class F>
+	void Run(const std::string &name, F body, double opsPerCall = 1)
+	{
+		if (name.find(filter) == std::string::npos)
+			return;
+		long long reps = 1;
+		while (Seconds(body, reps) < sampleTime / 4) // also the warm up
+			reps *= 2;
+		reps = std::max(1LL, (long long)(reps * sampleTime / Seconds(body, reps)));
+		std::vector<double> samples(nSamples);
+		for (double &sample : samples)
+			sample = Seconds(body, reps) * 1e9 / reps / opsPerCall;
+		double median = Median(samples);
+		std::vector<double> deviations;
+		for (double sample : samples)
+			deviations.push_back(fabs(sample - median));
+		BenchResult result = {name, median, Median(deviations) / median * 100, 1e9 / median};
+		results.push_back(result);
+		printf("%-32s %12.2f ns/op  +-%5.1f%%  %14.0f op/s\n", name.c_str(), result.median, result.spread, result.opsPerSecond);
+		fflush(stdout);
+	}
+
+	void Save(const char *fileName)
+	{
+		FILE *file = fopen(fileName, "w");
+		if (!file)
+		{
+			printf("Cannot write %s\n", fileName);
+			return;
+		}
+		for (const BenchResult &result : results)
+			fprintf(file, "%s\t%f\t%f\n", result.name.c_str(), result.median, result.spread); // names contain spaces
+		fclose(file);
+		printf("Baseline written to %s\n", fileName);
+	}
+
+	// a change counts when it exceeds both 5% and three times the combined spread
+	bool Compare(const char *fileName)
+	{
+		FILE *file = fopen(fileName, "r");
+		if (!file)
+		{
+			printf("Cannot read %s\n", fileName);
+			return false;
+		}
+		std::map<std::string, std::pair<double, double>> baseline;
+		char line[512], name[256];
+		double median, spread;
+		while (fgets(line, sizeof(line), file))
+			if (sscanf(line, "%255[^\t]\t%lf\t%lf", name, &median, &spread) == 3)
+				baseline[name] = std::make_pair(median, spread);
+		fclose(file);
+
+		bool regression = false;
+		printf("\n%-32s %12s %12s %8s\n", "benchmark", "baseline", "now", "change");
+		for (const BenchResult &result : results)
+		{
+			auto base = baseline.find(result.name);
+			if (base == baseline.end())
+				continue;
+			double change = (result.median / base->second.first - 1) * 100;
+			double noise = std::max(5.0, 3 * (result.spread + base->second.second));
+			const char *verdict = change > noise ? "slower" : change < -noise ? "faster" : "";
+			regression |= change > noise;
+			printf("%-32s %12.2f %12.2f %+7.1f%% %s\n", result.name.c_str(), base->second.first, result.median, change, verdict);
+		}
+		return !regression;
+	}
+};
+
+// 24 bit true color bmp as Texture::load expects it
+void WriteBmp(const char *fileName, int width, int height)
+{
+	unsigned int rowSize = width * 3, size = rowSize * height; // rows are 4 byte aligned for widths of multiples of 4
+	unsigned char header[54] = {'B', 'M'};
+	auto put = [&header](int offset, unsigned int value, int bytes)
+	{
+		for (int i = 0; i < bytes; i++)
+			header[offset + i] = (value >> (8 * i)) & 0xff;
+	};
+	put(2, 54 + size, 4);
+	put(10, 54, 4);
+	put(14, 40, 4);
+	put(18, width, 4);
+	put(22, height, 4);
+	put(26, 1, 2);
+	put(28, 24, 2);
+	put(34, size, 4);
+	std::vector<unsigned char> pixels(size);
+	for (unsigned int i = 0; i < size; i++)
+		pixels[i] = (i * 7) & 0xff;
+	FILE *file = fopen(fileName, "wb");
+	fwrite(header, 1, sizeof(header), file);
+	fwrite(&pixels[0], 1, size, file);
+	fclose(file);
+}
+
+// n balls in 8 materials spread over the bowl, 48 bytes per object
+void WriteScene(const char *fileName, unsigned int n)
+{
+	SceneFile::CameraRecord camera = {{0, 4, 8}, {0, 0, 1}, {0, 1, 0}, 75};
+	std::vector<SceneFile::MaterialRecord> materials(8, {{0.6f, 0.4f, 0.2f}, {4, 4, 4}, {0.1f, 0.1f, 0.1f}, 100});
+	std::vector<SceneFile::LightRecord> lights(2, {{0.1f, 0.1f, 0.1f}, {3, 3, 3}, {5, 5, 4, 0}, 0});
+	std::vector<SceneFile::ObjectRecord> objects(n);
+	for (unsigned int i = 0; i < n; i++)
+	{
+		float a = fmodf(i * 0.618034f, 1), b = fmodf(i * 0.754878f, 1);
+		objects[i] = {SceneFile::SHADER_GOURAUD, SceneFile::TEXTURE_CHECKER, SceneFile::GEOMETRY_SPHERE, 0, i % 8,
+					  {3.6f * a - 1.8f, 3.6f * b - 1.8f, 2.5f}, {0.01f, 0.01f, 0.01f}, {0, 0, 1}, 0};
+	}
+	SceneFile::Write(fileName, camera, materials, lights, objects);
+}
+
+// the live meshes of a pool do not overlap, fit in the capacity and add up to the used vertices
+bool Consistent(const GeometryPool &pool, const std::vector<int> &handles)
+{
+	std::vector<GeometryPool::Allocation> live;
+	for (int handle : handles)
+		if (handle >= 0 && pool.Get(handle).live)
+			live.push_back(pool.Get(handle));
+	std::sort(live.begin(), live.end(), [](const GeometryPool::Allocation &a, const GeometryPool::Allocation &b)
+			  { return a.firstVertex < b.firstVertex; });
+	unsigned int end = 0, used = 0;
+	for (const GeometryPool::Allocation &a : live)
+	{
+		if (a.firstVertex < end)
+			return false;
+		end = a.firstVertex + a.nVertices;
+		used += a.nVertices;
+	}
+	return end <= pool.VertexCapacity() && used == pool.UsedVertices();
+}
+
+// free list merging, compaction and growth of the geometry pool, headless only the offsets are moved
+bool CheckGeometryPool()
+{
+	bool ok = true;
+	auto expect = [&ok](bool condition, const char *what)
+	{
+		if (!condition)
+		{
+			printf("Geometry pool check failed: %s\n", what);
+			ok = false;
+		}
+	};
+	GeometryPool pool;
+	const std::vector<GeometryPool::Attribute> format = {{3, GL_FLOAT, false, 0}};
+	std::vector<vec3> vertices(1000);
+	std::vector<unsigned int> indices(100);
+	std::vector<int> handles;
+	for (int i = 0; i < 40; i++)
+		handles.push_back(pool.Allocate(&vertices[0], 1000, sizeof(vec3), format, indices));
+	expect(pool.VertexCapacity() == 64 * 1024 && pool.UsedVertices() == 40000 && pool.FreeRanges() == 2, "packed allocation");
+	expect(pool.Get(handles[39]).firstVertex == 39000 && pool.Get(handles[39]).firstIndex == 3900, "first fit order");
+
+	pool.Free(handles[1]);
+	pool.Free(handles[3]);
+	expect(pool.FreeRanges() == 6, "separate holes");
+	pool.Free(handles[2]); // joins both neighbours
+	expect(pool.FreeRanges() == 4, "merge with the neighbours");
+	handles[1] = pool.Allocate(&vertices[0], 1000, sizeof(vec3), format, indices);
+	expect(pool.Get(handles[1]).firstVertex == 1000, "reuse of the merged hole");
+	handles[2] = handles[3] = -1;
+	expect(Consistent(pool, handles), "consistent after merging");
+
+	int repacks = pool.repacks;
+	for (int i = 5; i < 40; i += 2)
+	{ // every other mesh, more holes than maxFragments
+		pool.Free(handles[i]);
+		handles[i] = -1;
+	}
+	expect(pool.repacks == repacks + 1, "compaction of the holes");
+	expect(pool.FreeRanges() < 2 * 16, "holes closed");
+	expect(Consistent(pool, handles), "consistent after compaction");
+	std::vector<unsigned int> firsts;
+	for (int handle : handles)
+		if (handle >= 0)
+			firsts.push_back(pool.Get(handle).firstVertex);
+	expect(std::is_sorted(firsts.begin(), firsts.end()), "compaction keeps the order");
+
+	std::vector<vec3> large(60000);
+	int largeHandle = pool.Allocate(&large[0], large.size(), sizeof(vec3), format, indices);
+	handles.push_back(largeHandle);
+	expect(pool.VertexCapacity() == 128 * 1024 && Consistent(pool, handles), "growth when more than 3/4 full");
+
+	std::vector<vec4> wide(10);
+	expect(pool.Allocate(&wide[0], wide.size(), sizeof(vec4), format, indices) < 0, "other vertex format refused");
+	pool.Free(-1);
+	pool.Free(1000);
+	pool.Release();
+	pool.Free(largeHandle); // after the release
+	expect(pool.UsedVertices() == 0 && pool.FreeRanges() == 0, "release");
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	headless = true;
+	std::string filter;
+	const char *saveFile = nullptr, *compareFile = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--save" && i + 1 < argc)
+			saveFile = argv[++i];
+		else if (arg == "--compare" && i + 1 < argc)
+			compareFile = argv[++i];
+		else if (arg == "--check")
+		{
+			bool ok = CheckGeometryPool();
+			printf("Geometry pool checks %s\n", ok ? "passed" : "failed");
+			return ok ? 0 : 1;
+		}
+		else
+			filter = arg;
+	}
+	Bench bench(filter);
+
+	// math
+	mat4 A = RotationMatrix(0.3f, vec3(1, 2, 3)), B = RotationMatrix(0.01f, vec3(0, 1, 0)); // orthonormal, no overflow
+	bench.Run("mat4 multiply", [&]()
+			  { A = A * B; Consume(A); });
+	float angle = 0;
+	bench.Run("RotationMatrix", [&]()
+			  { angle += 0.001f; Consume(RotationMatrix(angle, vec3(0.3f, 1, 0.2f))); });
+	vec4 point(1, 2, 3, 1);
+	bench.Run("transform chain", [&]()
+			  {
+				  angle += 0.001f;
+				  mat4 M = ScaleMatrix(vec3(0.2f, 0.2f, 0.2f)) * RotationMatrix(angle, vec3(0, 0, 1)) * TranslateMatrix(vec3(1, 2, 3));
+				  Consume(point * M * A);
+			  });
+
+	// dual numbers, the argument is varied so the calls cannot be hoisted
+	Dnum2 x(0.5f, vec2(1, 0));
+	float dx = 1e-7f;
+	bench.Run("Dnum Exp", [&]()
+			  { x.f += dx; Consume(Exp(x)); });
+	bench.Run("Dnum Sin", [&]()
+			  { x.f += dx; Consume(Sin(x)); });
+	bench.Run("Dnum Cos", [&]()
+			  { x.f += dx; Consume(Cos(x)); });
+	bench.Run("Dnum Tan", [&]()
+			  { x.f += dx; Consume(Tan(x)); });
+	bench.Run("Dnum Sinh", [&]()
+			  { x.f += dx; Consume(Sinh(x)); });
+	bench.Run("Dnum Cosh", [&]()
+			  { x.f += dx; Consume(Cosh(x)); });
+	bench.Run("Dnum Tanh", [&]()
+			  { x.f += dx; Consume(Tanh(x)); });
+	bench.Run("Dnum Log", [&]()
+			  { x.f += dx; Consume(Log(x)); });
+	bench.Run("Dnum Pow", [&]()
+			  { x.f += dx; Consume(Pow(x, 2)); });
+
+	// surfaces
+	Bowl bowl(1, 1);
+	Sphere sphere;
+	float u = 0;
+	bench.Run("Bowl GenVertexData", [&]()
+			  { u = u < 1 ? u + 0.001f : 0; Consume(bowl.GenVertexData(u, 1 - u).normal); });
+	bench.Run("Sphere GenVertexData", [&]()
+			  { u = u < 1 ? u + 0.001f : 0; Consume(sphere.GenVertexData(u, 1 - u).normal); });
+
+	// tessellation, per vertex of all levels of detail including the compression
+	for (int level : {10, 20, 40, 80})
+	{
+		std::vector<float> knots = ParamSurface::UniformKnots(level);
+		unsigned int nVertices = sphere.Tessellate(knots, knots).size();
+		bench.Run("Sphere tessellate " + std::to_string(level), [&]()
+				  {
+					  std::vector<ParamSurface::VertexData> vtxData = sphere.Tessellate(knots, knots);
+					  Consume(sphere.Compress(vtxData)[0].position[0]);
+				  },
+				  nVertices);
+	}
+	unsigned int nBowlVertices = bowl.Tessellate(bowl.uKnots, bowl.vKnots).size();
+	std::vector<float> bowlU = bowl.uKnots, bowlV = bowl.vKnots;
+	bench.Run("Bowl tessellate adaptive", [&]()
+			  {
+				  std::vector<ParamSurface::VertexData> vtxData = bowl.Tessellate(bowlU, bowlV);
+				  Consume(bowl.Compress(vtxData)[0].position[0]);
+			  },
+			  nBowlVertices);
+	bench.Run("Bowl adaptive knots", [&]()
+			  { Consume(bowl.AdaptiveKnots(tessellationError, true).back()); });
+
+	// per tile light lists, per light, the lights are spread over the bowl like the orbiting lights of the scene
+	Camera camera;
+	camera.wEye = vec3(0, 4, 8);
+	camera.wLookat = vec3(0, 0, 1);
+	camera.wVup = vec3(0, 1, 0);
+	mat4 V = camera.V(), P = camera.P();
+	LightGrid grid;
+	for (int nLights : {2, 8, 64, 256})
+	{
+		std::vector<Light> lights(nLights);
+		for (int i = 0; i < nLights; i++)
+		{
+			float a = fmodf(i * 0.618034f, 1), b = fmodf(i * 0.754878f, 1);
+			lights[i].wLightPos = vec4((4 * a - 2) * cosf(7 * b), (4 * a - 2) * sinf(7 * b), 2.4f + b, 1);
+			lights[i].range = 1;
+		}
+		bench.Run("LightGrid build " + std::to_string(nLights), [&]()
+				  {
+					  grid.Build(lights, V, P, windowWidth, windowHeight);
+					  Consume((float)grid.total);
+				  },
+				  nLights);
+	}
+
+	// ball collisions, per step: the balls move a tenth of their radius, then the grid is sorted and the pairs tested,
+	// random balls on the bowl at half coverage of the (x, y) domain
+	for (unsigned int n : {10000, 100000, 1000000})
+	{
+		BallCollisions collisions(sqrtf(0.5f * 16 / (float)M_PI / n));
+		std::vector<BallCollisions::Body> bodies(n);
+		srand(1);
+		for (BallCollisions::Body &body : bodies)
+		{
+			float x = 4.0f * rand() / RAND_MAX - 2, y = 4.0f * rand() / RAND_MAX - 2;
+			body.position = vec3(x, y, 2 * coshf((x * x + y * y) / 4));
+			body.velocity = vec3(rand() % 3 - 1.0f, rand() % 3 - 1.0f, 0);
+		}
+		collisions.Step(bodies); // initial sort
+		unsigned long long tests = 0, steps = 0;
+		std::string name = "BallCollisions step " + (n >= 1000000 ? std::to_string(n / 1000000) + "M" : std::to_string(n / 1000) + "k");
+		bench.Run(name, [&]()
+				  {
+					  for (BallCollisions::Body &body : bodies)
+						  body.position = body.position + vec3(body.velocity.x, body.velocity.y, 0) * (0.1f * collisions.radius) + vec3(body.push.x, body.push.y, 0);
+					  collisions.Step(bodies);
+					  tests += collisions.pairTests;
+					  steps++;
+					  Consume((float)collisions.contacts);
+				  });
+		if (steps && bench.results.back().name == name)
+			printf("%-32s %12.2f ms/step  %llu pair tests/step (%.1f per ball)\n", "", bench.results.back().median / 1e6, tests / steps, (double)tests / steps / n);
+	}
+
+	// texture decoding, per texel
+	const char *bmpFile = "bench_texture.bmp";
+	WriteBmp(bmpFile, 512, 512);
+	bench.Run("Texture::load 512x512", [&]()
+			  {
+				  int width, height;
+				  Consume(Texture::load(bmpFile, false, width, height)[0]);
+			  },
+			  512 * 512);
+	remove(bmpFile);
+
+	// scene loading, per object: mapping, validation and the tables of the scene, the bowl and the sphere are tessellated once per load
+	const char *sceneFile = "bench_scene.bin";
+	for (unsigned int nObjects : {1000, 100000, 1000000})
+	{
+		WriteScene(sceneFile, nObjects);
+		bench.Run("Scene load " + (nObjects >= 1000000 ? std::to_string(nObjects / 1000000) + "M" : std::to_string(nObjects / 1000) + "k"), [&]()
+				  {
+					  SceneFile file;
+					  file.Open(sceneFile);
+					  scene.Load(file);
+					  Consume((float)scene.ObjectCount());
+				  },
+				  nObjects);
+	}
+	scene.Destroy();
+	remove(sceneFile);
+
+	if (saveFile)
+		bench.Save(saveFile);
+	if (compareFile && !bench.Compare(compareFile))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,11 @@
+#! /bin/bash
+
+# usage: check.sh, exits with 1 when a check fails, the program needs a display (xvfb-run ./check.sh on a server)
+# the geometry pool bookkeeping of bench, a ball stepped on the GPU and the CPU, 120 frames whose rendering must not
+# allocate after the first, then 120 frames of the program that must leave no GL object alive
+g++ -O2 bench/bench.cpp -o bench.out -lglut -lGLEW -lGL -lGLU && ./bench.out --check || exit 1
+g++ -DALLOCATION_COUNTING ./Skeleton.cpp framework.cpp -o check.out -lglut -lGLEW -lGL -lGLU || exit 1
+CHECK_BALLS=1 ./check.out || exit 1
+FRAMES=120 MAX_RENDER_ALLOCATIONS=0 ./check.out || exit 1
+g++ -DGL_ACCOUNTING ./Skeleton.cpp framework.cpp -o check.out -lglut -lGLEW -lGL -lGLU || exit 1
+FRAMES=120 GL_MAX_LIVE_RESOURCES=0 ./check.out
\ No newline at end of file
@@ -23,6 +23,10 @@
 #include <GL/freeglut.h>	// must be downloaded unless you have an Apple
 #endif
 
+#if defined(GL_ACCOUNTING)
+#include "glaccounting.h"	// counts GL calls and tracks live GL objects
+#endif
+
 // Resolution of screen
 const unsigned int windowWidth = 600, windowHeight = 600;
 
@@ -163,7 +167,8 @@ inline mat4 RotationMatrix(float angle, vec3 w) {
 //---------------------------
 class Texture {
 //---------------------------
-	std::vector<vec4> load(std::string pathname, bool transparent, int& width, int& height) {
+public:
+	static std::vector<vec4> load(std::string pathname, bool transparent, int& width, int& height) {
 		FILE * file = fopen(pathname.c_str(), "r");
 		if (!file) {
 			printf("%s does not exist\n", pathname.c_str());
@@ -190,7 +195,6 @@ class Texture {
 		return image;
 	}
 
-public:
 	unsigned int textureId = 0;
 
 	Texture() { textureId = 0; }
@@ -239,6 +243,7 @@ class GPUProgram {
 	unsigned int shaderProgramId = 0;
 	unsigned int vertexShader = 0, geometryShader = 0, fragmentShader = 0;
 	bool waitError = true;
+	std::vector<std::string> feedbackVaryings;	// vertex shader outputs captured by transform feedback
 
 	void getErrorInfo(unsigned int handle) { // shader error report
 		int logLen, written;
@@ -292,6 +297,10 @@ public:
 
 	unsigned int getId() { return shaderProgramId; }
 
+	void setFeedbackVaryings(const std::vector<std::string>& varyings) { // call before create
+		feedbackVaryings = varyings;
+	}
+
 	bool create(const char * const vertexShaderSource,
 		        const char * const fragmentShaderSource, const char * const fragmentShaderOutputName,
 		        const char * const geometryShaderSource = nullptr)
@@ -338,6 +347,13 @@ public:
 		glAttachShader(shaderProgramId, fragmentShader);
 		if (geometryShader > 0) glAttachShader(shaderProgramId, geometryShader);
 
+		// Outputs written into buffer objects by transform feedback, interleaved in the given order
+		if (feedbackVaryings.size() > 0) {
+			std::vector<const char *> names;
+			for (const std::string& varying : feedbackVaryings) names.push_back(varying.c_str());
+			glTransformFeedbackVaryings(shaderProgramId, (int)names.size(), &names[0], GL_INTERLEAVED_ATTRIBS);
+		}
+
 		// Connect the fragmentColor to the frame buffer memory
 		glBindFragDataLocation(shaderProgramId, 0, fragmentShaderOutputName);	// this output goes to the frame buffer memory
 
@@ -393,5 +409,10 @@ public:
 		}
 	}
 
-	~GPUProgram() { if (shaderProgramId > 0) glDeleteProgram(shaderProgramId); }
+	~GPUProgram() {
+		if (shaderProgramId > 0) glDeleteProgram(shaderProgramId);
+		if (vertexShader > 0) glDeleteShader(vertexShader);
+		if (geometryShader > 0) glDeleteShader(geometryShader);
+		if (fragmentShader > 0) glDeleteShader(fragmentShader);
+	}
 };
\ No newline at end of file
@@ -0,0 +1,323 @@
+//=============================================================================================
+// GL call and resource accounting, included by framework.h when GL_ACCOUNTING is defined.
+// The GL entry points used by the framework and the program are redirected to wrappers that
+// count the calls per frame and track the live buffers, textures, vertex arrays, programs,
+// shaders and queries with their sizes and creation sites.
+//
+// Report:    glAccounting().Report() on demand, Shutdown() after the program released its objects
+// Headless:  GL_MAX_LIVE_RESOURCES=<n> makes Shutdown exit with 1 if more remain alive
+//=============================================================================================
+#pragma once
+#include <map>
+
+//--------------------------
+class GLAccounting {
+//--------------------------
+	struct Resource {
+		const char *kind, *file;
+		int line;
+		size_t bytes;
+	};
+	std::map<std::string, unsigned int> calls, lastFrameCalls; // per frame
+	std::map<std::pair<std::string, GLuint>, Resource> live;     // kind and name
+	std::map<GLenum, GLuint> boundBuffers, boundTextures;          // target of buffers, unit of 2D textures
+	GLenum activeTexture = GL_TEXTURE0;
+	unsigned long long totalCalls = 0;
+
+public:
+	static GLAccounting& glAccounting();
+
+	unsigned int& Counter(const char *name) { return calls[name]; }
+
+	void Create(const char *kind, GLuint name, const char *file, int line) {
+		live[std::make_pair(std::string(kind), name)] = { kind, file, line, 0 };
+	}
+	void Delete(const char *kind, GLuint name) { live.erase(std::make_pair(std::string(kind), name)); }
+	void Resize(const char *kind, GLuint name, size_t bytes) {
+		auto resource = live.find(std::make_pair(std::string(kind), name));
+		if (resource != live.end()) resource->second.bytes = bytes;
+	}
+
+	void BindBuffer(GLenum target, GLuint buffer) { boundBuffers[target] = buffer; }
+	void BufferData(GLenum target, size_t bytes) { Resize("buffer", boundBuffers[target], bytes); }
+	void ActiveTexture(GLenum unit) { activeTexture = unit; }
+	void BindTexture(GLuint texture) { boundTextures[activeTexture] = texture; }
+	void TexImage(GLint internalFormat, int width, int height) {
+		int texelSize = (internalFormat == GL_RGBA32F) ? 16 : (internalFormat == GL_RGBA16F) ? 8 : 4;
+		Resize("texture", boundTextures[activeTexture], (size_t)width * height * texelSize);
+	}
+	void CompressedTexImage(size_t bytes) { Resize("texture", boundTextures[activeTexture], bytes); }
+
+	void EndFrame() {
+		lastFrameCalls = calls;
+		for (auto& call : calls) {
+			totalCalls += call.second;
+			call.second = 0;
+		}
+	}
+
+	void Report() {
+		printf("GL calls in the last frame:\n");
+		for (auto& call : lastFrameCalls)
+			if (call.second > 0) printf("  %-28s %u\n", call.first.c_str(), call.second);
+		std::map<std::string, std::pair<unsigned int, size_t>> totals; // count and bytes per kind
+		for (auto& resource : live) {
+			totals[resource.second.kind].first++;
+			totals[resource.second.kind].second += resource.second.bytes;
+		}
+		printf("GL live resources: %d\n", (int)live.size());
+		for (auto& total : totals)
+			printf("  %-10s %6u %10lu bytes\n", total.first.c_str(), total.second.first, (unsigned long)total.second.second);
+		std::map<std::string, unsigned int> sites; // creation sites of the live resources
+		for (auto& resource : live)
+			sites[std::string(resource.second.kind) + " " + resource.second.file + ":" + std::to_string(resource.second.line)]++;
+		for (auto& site : sites)
+			printf("  %6u x %s\n", site.second, site.first.c_str());
+	}
+
+	// from the shutdown path of the program while the context is alive, not from an exit handler that would run
+	// before the destructors of the globals
+	void Shutdown() {
+		Report();
+		const char *limit = getenv("GL_MAX_LIVE_RESOURCES");
+		if (limit && live.size() > (size_t)atoi(limit)) {
+			printf("GL accounting: %d live resources exceed the limit of %s\n", (int)live.size(), limit);
+			exit(1);
+		}
+	}
+};
+
+inline GLAccounting& GLAccounting::glAccounting() {
+	static GLAccounting *accounting = new GLAccounting(); // never destroyed, usable until the process ends
+	return *accounting;
+}
+
+inline GLAccounting& glAccounting() { return GLAccounting::glAccounting(); }
+
+// counts the call and returns the original entry point, that may itself be a function pointer of the loader,
+// so the arguments are converted to its parameter types as usual
+#define GL_COUNTED(name) \
+	inline auto& name##_counted() { \
+		static unsigned int& counter = glAccounting().Counter(#name); \
+		counter++; \
+		return name; \
+	}
+
+// creation and deletion of named objects with the creation site
+#define GL_GEN_TRACKED(name, kind) \
+	GL_COUNTED(name) \
+	inline void name##_tracked(GLsizei n, GLuint *ids, const char *file, int line) { \
+		name##_counted()(n, ids); \
+		for (GLsizei i = 0; i < n; i++) glAccounting().Create(kind, ids[i], file, line); \
+	}
+#define GL_DELETE_TRACKED(name, kind) \
+	GL_COUNTED(name) \
+	inline void name##_tracked(GLsizei n, const GLuint *ids) { \
+		name##_counted()(n, ids); \
+		for (GLsizei i = 0; i < n; i++) glAccounting().Delete(kind, ids[i]); \
+	}
+
+GL_GEN_TRACKED(glGenBuffers, "buffer")
+GL_DELETE_TRACKED(glDeleteBuffers, "buffer")
+GL_GEN_TRACKED(glGenVertexArrays, "vao")
+GL_DELETE_TRACKED(glDeleteVertexArrays, "vao")
+GL_GEN_TRACKED(glGenTextures, "texture")
+GL_DELETE_TRACKED(glDeleteTextures, "texture")
+GL_GEN_TRACKED(glGenQueries, "query")
+GL_DELETE_TRACKED(glDeleteQueries, "query")
+
+GL_COUNTED(glCreateProgram)
+inline GLuint glCreateProgram_tracked(const char *file, int line) {
+	GLuint program = glCreateProgram_counted()();
+	glAccounting().Create("program", program, file, line);
+	return program;
+}
+GL_COUNTED(glDeleteProgram)
+inline void glDeleteProgram_tracked(GLuint program) {
+	glDeleteProgram_counted()(program);
+	glAccounting().Delete("program", program);
+}
+GL_COUNTED(glCreateShader)
+inline GLuint glCreateShader_tracked(GLenum type, const char *file, int line) {
+	GLuint shader = glCreateShader_counted()(type);
+	glAccounting().Create("shader", shader, file, line);
+	return shader;
+}
+GL_COUNTED(glDeleteShader)
+inline void glDeleteShader_tracked(GLuint shader) {
+	glDeleteShader_counted()(shader);
+	glAccounting().Delete("shader", shader);
+}
+
+GL_COUNTED(glBindBuffer)
+inline void glBindBuffer_tracked(GLenum target, GLuint buffer) {
+	glBindBuffer_counted()(target, buffer);
+	glAccounting().BindBuffer(target, buffer);
+}
+GL_COUNTED(glBindBufferBase)
+inline void glBindBufferBase_tracked(GLenum target, GLuint index, GLuint buffer) {
+	glBindBufferBase_counted()(target, index, buffer);
+	glAccounting().BindBuffer(target, buffer); // also the generic binding point
+}
+GL_COUNTED(glBufferData)
+inline void glBufferData_tracked(GLenum target, GLsizeiptr size, const void *data, GLenum usage) {
+	glBufferData_counted()(target, size, data, usage);
+	glAccounting().BufferData(target, size);
+}
+GL_COUNTED(glActiveTexture)
+inline void glActiveTexture_tracked(GLenum unit) {
+	glActiveTexture_counted()(unit);
+	glAccounting().ActiveTexture(unit);
+}
+GL_COUNTED(glBindTexture)
+inline void glBindTexture_tracked(GLenum target, GLuint texture) {
+	glBindTexture_counted()(target, texture);
+	if (target == GL_TEXTURE_2D) glAccounting().BindTexture(texture);
+}
+GL_COUNTED(glTexImage2D)
+inline void glTexImage2D_tracked(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height,
+								 GLint border, GLenum format, GLenum type, const void *data) {
+	glTexImage2D_counted()(target, level, internalFormat, width, height, border, format, type, data);
+	if (target == GL_TEXTURE_2D && level == 0) glAccounting().TexImage(internalFormat, width, height);
+}
+GL_COUNTED(glCompressedTexImage2D)
+inline void glCompressedTexImage2D_tracked(GLenum target, GLint level, GLenum internalFormat, GLsizei width, GLsizei height,
+										   GLint border, GLsizei imageSize, const void *data) {
+	glCompressedTexImage2D_counted()(target, level, internalFormat, width, height, border, imageSize, data);
+	if (target == GL_TEXTURE_2D && level == 0) glAccounting().CompressedTexImage(imageSize);
+}
+
+GL_COUNTED(glDrawArrays)
+GL_COUNTED(glDrawArraysInstanced)
+GL_COUNTED(glDrawElementsInstanced)
+GL_COUNTED(glDrawElementsInstancedBaseVertex)
+GL_COUNTED(glBindVertexArray)
+GL_COUNTED(glVertexAttribPointer)
+GL_COUNTED(glEnableVertexAttribArray)
+GL_COUNTED(glVertexAttribDivisor)
+GL_COUNTED(glBufferSubData)
+GL_COUNTED(glCopyBufferSubData)
+GL_COUNTED(glUseProgram)
+GL_COUNTED(glGetUniformLocation)
+GL_COUNTED(glUniform1i)
+GL_COUNTED(glUniform1f)
+GL_COUNTED(glUniform2fv)
+GL_COUNTED(glUniform3fv)
+GL_COUNTED(glUniform4fv)
+GL_COUNTED(glUniformMatrix4fv)
+GL_COUNTED(glTexParameteri)
+GL_COUNTED(glShaderSource)
+GL_COUNTED(glCompileShader)
+GL_COUNTED(glLinkProgram)
+GL_COUNTED(glBeginTransformFeedback)
+GL_COUNTED(glEndTransformFeedback)
+GL_COUNTED(glBeginQuery)
+GL_COUNTED(glEndQuery)
+GL_COUNTED(glGetQueryObjectiv)
+GL_COUNTED(glGetQueryObjectui64v)
+GL_COUNTED(glEnable)
+GL_COUNTED(glDisable)
+GL_COUNTED(glClear)
+
+// the entry points are redirected from here on
+#undef glGenBuffers
+#define glGenBuffers(n, ids) glGenBuffers_tracked(n, ids, __FILE__, __LINE__)
+#undef glDeleteBuffers
+#define glDeleteBuffers glDeleteBuffers_tracked
+#undef glGenVertexArrays
+#define glGenVertexArrays(n, ids) glGenVertexArrays_tracked(n, ids, __FILE__, __LINE__)
+#undef glDeleteVertexArrays
+#define glDeleteVertexArrays glDeleteVertexArrays_tracked
+#undef glGenTextures
+#define glGenTextures(n, ids) glGenTextures_tracked(n, ids, __FILE__, __LINE__)
+#undef glDeleteTextures
+#define glDeleteTextures glDeleteTextures_tracked
+#undef glGenQueries
+#define glGenQueries(n, ids) glGenQueries_tracked(n, ids, __FILE__, __LINE__)
+#undef glDeleteQueries
+#define glDeleteQueries glDeleteQueries_tracked
+#undef glCreateProgram
+#define glCreateProgram() glCreateProgram_tracked(__FILE__, __LINE__)
+#undef glDeleteProgram
+#define glDeleteProgram glDeleteProgram_tracked
+#undef glCreateShader
+#define glCreateShader(type) glCreateShader_tracked(type, __FILE__, __LINE__)
+#undef glDeleteShader
+#define glDeleteShader glDeleteShader_tracked
+#undef glBindBuffer
+#define glBindBuffer glBindBuffer_tracked
+#undef glBindBufferBase
+#define glBindBufferBase glBindBufferBase_tracked
+#undef glBufferData
+#define glBufferData glBufferData_tracked
+#undef glActiveTexture
+#define glActiveTexture glActiveTexture_tracked
+#undef glBindTexture
+#define glBindTexture glBindTexture_tracked
+#undef glTexImage2D
+#define glTexImage2D glTexImage2D_tracked
+#undef glCompressedTexImage2D
+#define glCompressedTexImage2D glCompressedTexImage2D_tracked
+
+#undef glDrawArrays
+#define glDrawArrays glDrawArrays_counted()
+#undef glDrawArraysInstanced
+#define glDrawArraysInstanced glDrawArraysInstanced_counted()
+#undef glDrawElementsInstanced
+#define glDrawElementsInstanced glDrawElementsInstanced_counted()
+#undef glDrawElementsInstancedBaseVertex
+#define glDrawElementsInstancedBaseVertex glDrawElementsInstancedBaseVertex_counted()
+#undef glBindVertexArray
+#define glBindVertexArray glBindVertexArray_counted()
+#undef glVertexAttribPointer
+#define glVertexAttribPointer glVertexAttribPointer_counted()
+#undef glEnableVertexAttribArray
+#define glEnableVertexAttribArray glEnableVertexAttribArray_counted()
+#undef glVertexAttribDivisor
+#define glVertexAttribDivisor glVertexAttribDivisor_counted()
+#undef glBufferSubData
+#define glBufferSubData glBufferSubData_counted()
+#undef glCopyBufferSubData
+#define glCopyBufferSubData glCopyBufferSubData_counted()
+#undef glUseProgram
+#define glUseProgram glUseProgram_counted()
+#undef glGetUniformLocation
+#define glGetUniformLocation glGetUniformLocation_counted()
+#undef glUniform1i
+#define glUniform1i glUniform1i_counted()
+#undef glUniform1f
+#define glUniform1f glUniform1f_counted()
+#undef glUniform2fv
+#define glUniform2fv glUniform2fv_counted()
+#undef glUniform3fv
+#define glUniform3fv glUniform3fv_counted()
+#undef glUniform4fv
+#define glUniform4fv glUniform4fv_counted()
+#undef glUniformMatrix4fv
+#define glUniformMatrix4fv glUniformMatrix4fv_counted()
+#undef glTexParameteri
+#define glTexParameteri glTexParameteri_counted()
+#undef glShaderSource
+#define glShaderSource glShaderSource_counted()
+#undef glCompileShader
+#define glCompileShader glCompileShader_counted()
+#undef glLinkProgram
+#define glLinkProgram glLinkProgram_counted()
+#undef glBeginTransformFeedback
+#define glBeginTransformFeedback glBeginTransformFeedback_counted()
+#undef glEndTransformFeedback
+#define glEndTransformFeedback glEndTransformFeedback_counted()
+#undef glBeginQuery
+#define glBeginQuery glBeginQuery_counted()
+#undef glEndQuery
+#define glEndQuery glEndQuery_counted()
+#undef glGetQueryObjectiv
+#define glGetQueryObjectiv glGetQueryObjectiv_counted()
+#undef glGetQueryObjectui64v
+#define glGetQueryObjectui64v glGetQueryObjectui64v_counted()
+#undef glEnable
+#define glEnable glEnable_counted()
+#undef glDisable
+#define glDisable glDisable_counted()
+#undef glClear
+#define glClear glClear_counted()
@@ -0,0 +1,4 @@
+#! /bin/bash
+
+# usage: sceneconv.sh <in> <out> | sceneconv.sh --generate <n> <out>
+g++ -O2 tools/sceneconv.cpp -o sceneconv.out -lglut -lGLEW -lGL -lGLU && ./sceneconv.out "$@"
@@ -0,0 +1,60 @@
+//=============================================================================================
+// Converts scenes between the text and the binary format of SceneFile, and generates test scenes of
+// many balls. Needs no GL context, build and run with sceneconv.sh.
+//
+// sceneconv <in> <out>                 text to binary, or binary to text when <in> is binary
+// sceneconv --generate <n> <out>       n balls on a grid over the bowl, binary unless <out> ends with .txt
+//=============================================================================================
+#include "../Skeleton.cpp"
+
+// the bowl, two directional lights, n balls in 8 materials on a square grid at the height of the bowl
+bool Generate(unsigned int n, const char *path)
+{
+	SceneFile::CameraRecord camera = {{0, 4, 8}, {0, 0, 1}, {0, 1, 0}, 75};
+	std::vector<SceneFile::MaterialRecord> materials;
+	for (int i = 0; i < 8; i++)
+		materials.push_back({{0.2f + 0.1f * i, 0.6f - 0.05f * i, 0.2f}, {4, 4, 4}, {0.1f, 0.1f, 0.1f}, 100});
+	std::vector<SceneFile::LightRecord> lights = {{{0.1f, 0.1f, 1}, {3, 0, 0}, {5, 5, 4, 0}, 0},
+												  {{0.1f, 0.1f, 0.1f}, {0, 0, 3}, {-5, 5, 5, 0}, 0}};
+	std::vector<SceneFile::ObjectRecord> objects;
+	objects.push_back({SceneFile::SHADER_BOWL, SceneFile::TEXTURE_BOWL, SceneFile::GEOMETRY_BOWL, 15, 0, {0, 0, 0}, {2, 2, 2}, {0, 0, 1}, 0});
+	unsigned int side = (unsigned int)ceil(sqrt((double)n));
+	float spacing = 3.6f / side;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		float x = -1.8f + spacing * (i % side + 0.5f), y = -1.8f + spacing * (i / side + 0.5f);
+		float z = 2 * height(x / 2, y / 2).z; // on the floor of the bowl
+		objects.push_back({SceneFile::SHADER_GOURAUD, SceneFile::TEXTURE_CHECKER, SceneFile::GEOMETRY_SPHERE, 0, i % 8,
+						   {x, y, z + 0.1f}, {0.4f * spacing, 0.4f * spacing, 0.4f * spacing}, {0, 0, 1}, 0});
+	}
+	std::string name = path;
+	if (name.size() < 4 || name.compare(name.size() - 4, 4, ".txt") != 0)
+		return SceneFile::Write(path, camera, materials, lights, objects);
+	std::string binary = name + ".bin";
+	SceneFile file;
+	bool ok = SceneFile::Write(binary.c_str(), camera, materials, lights, objects) && file.Open(binary.c_str()) && file.WriteText(path);
+	file.Close();
+	remove(binary.c_str());
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	headless = true;
+	if (argc == 4 && strcmp(argv[1], "--generate") == 0)
+		return Generate(atoi(argv[2]), argv[3]) ? 0 : 1;
+	if (argc != 3)
+	{
+		printf("usage: sceneconv <in> <out> | sceneconv --generate <n> <out>\n");
+		return 1;
+	}
+	FILE *in = fopen(argv[1], "rb");
+	unsigned int first = 0;
+	bool binary = in && fread(&first, sizeof(first), 1, in) == 1 && first == SceneFile::magic;
+	if (in)
+		fclose(in);
+	if (!binary)
+		return SceneFile::Convert(argv[1], argv[2]) ? 0 : 1;
+	SceneFile file;
+	return file.Open(argv[1]) && file.WriteText(argv[2]) ? 0 : 1;
+}